@@ -0,0 +1,206 @@
+#ifndef ACCEL_H
+#define ACCEL_H
+
+#include "grid.h"
+
+// acceleration structures behind one interface - scene::ray_query only sees an accelerator, and the backend
+// is picked by name at runtime. the linear scan is the reference every other backend has to agree with
+
+constexpr unsigned long long ACCEL_MISMATCH_REPORTS = 5; // validation mismatches printed, the rest are only counted
+
+struct accel_settings{ // what a backend may need to build - each one takes the parts it uses
+  bvh_params bvh;
+  std::string cache_dir; // bvh: directory of cached trees, empty to always build
+};
+
+class accelerator{
+public:
+  virtual ~accelerator() {}
+  virtual const char* name() const = 0;
+  virtual void build(const primitive_list& prims, worker_pool* pool) = 0;
+  virtual bool valid_for(const primitive_list& prims) const = 0; // built, and over this many primitives
+  virtual hitrecord intersect(const ray& r, const primitive_list& prims, render_stats* stats) const = 0; // closest hit
+  virtual bool intersect_any(const ray& r, base_type tmax, const primitive_list& prims, render_stats* stats) const = 0; // any hit in (0, tmax)
+  virtual aabb bounds() const = 0;
+  virtual size_t memory_usage() const = 0; // bytes, not counting the primitives
+  virtual uint64_t content_hash() const = 0; // of the primitives it was built over
+  // after primitives moved in place - true if it rebuilt rather than updated. threshold is how much worse than
+  // a fresh build the backend may let itself get, for those that can update
+  virtual bool refit(const primitive_list& prims, base_type threshold, worker_pool* pool){ (void)threshold; build(prims, pool); return true; }
+  virtual std::string summary() const = 0; // for the console report
+  virtual std::string json() const = 0;    // fields for the json report
+};
+
+class linear_accel : public accelerator { // every primitive, every ray - no build, no memory, the reference result
+public:
+  const char* name() const override { return "linear"; }
+  void build(const primitive_list& prims, worker_pool* pool) override {
+    box = aabb(); for(const auto& p : prims) box.grow(p->bounds());
+    hash = records_hash(records_of(prims, pool), pool);
+  }
+  bool valid_for(const primitive_list&) const override { return true; }
+  hitrecord intersect(const ray& r, const primitive_list& prims, render_stats* stats) const override { return scan(r, prims, stats); }
+  bool intersect_any(const ray& r, base_type tmax, const primitive_list& prims, render_stats* stats) const override { return scan_any(r, tmax, prims, stats); }
+  aabb bounds() const override { return box; }
+  size_t memory_usage() const override { return 0; }
+  uint64_t content_hash() const override { return hash; }
+  bool refit(const primitive_list& prims, base_type, worker_pool* pool) override { build(prims, pool); return false; }
+  std::string summary() const override { return "linear"; }
+  std::string json() const override { return ""; }
+
+  static hitrecord scan(const ray& r, const primitive_list& prims, render_stats* stats){
+    hitrecord h;
+    base_type current_min = DMAX_TRAVEL; // initially 'a big number'
+    if(stats) stats->intersection_tests += prims.size();
+    for(size_t i = 0; i < prims.size(); i++) {
+      hitrecord temp = prims[i]->intersect(r);
+      (temp.instance_index < 0 ? temp.primitive_index : temp.instance_index) = i;
+      if(temp.dtransit < DMAX_TRAVEL && temp.dtransit > 0. && temp.dtransit < current_min) {
+        current_min = temp.dtransit;
+        h = temp;
+      }
+    }
+    return h;
+  }
+  static bool scan_any(const ray& r, base_type tmax, const primitive_list& prims, render_stats* stats){
+    for(size_t i = 0; i < prims.size(); i++){
+      if(stats) stats->intersection_tests++;
+      const hitrecord temp = prims[i]->intersect(r);
+      if(temp.dtransit > 0. && temp.dtransit < tmax) return true;
+    }
+    return false;
+  }
+private:
+  aabb box;
+  uint64_t hash = 0;
+};
+
+class bvh_accel : public accelerator {
+public:
+  bvh_accel(const accel_settings& s) : settings(s) {}
+  const char* name() const override { return "bvh"; }
+  void build(const primitive_list& prims, worker_pool* pool) override { tree.build(prims, settings.cache_dir, settings.bvh, pool); }
+  bool valid_for(const primitive_list& prims) const override { return tree.valid_for(prims); }
+  hitrecord intersect(const ray& r, const primitive_list& prims, render_stats* stats) const override { return tree.intersect(r, prims, stats); }
+  bool intersect_any(const ray& r, base_type tmax, const primitive_list& prims, render_stats* stats) const override { return tree.intersect_any(r, tmax, prims, stats); }
+  aabb bounds() const override { return tree.bounds(); }
+  size_t memory_usage() const override { return tree.memory_usage(); }
+  uint64_t content_hash() const override { return tree.content_hash(); }
+  // refits until the SAH cost has grown past (1 + threshold) times the cost it was built with, then rebuilds
+  bool refit(const primitive_list& prims, base_type threshold, worker_pool* pool) override {
+    if(!tree.valid_for(prims)){ build(prims, pool); return true; }
+    tree.refit(prims, pool);
+    if(tree.sah_cost() <= tree.build_cost() * (1. + threshold)) return false;
+    tree.build(prims, "", settings.bvh, pool);
+    return true;
+  }
+  std::string summary() const override {
+    std::stringstream s;
+    s << "bvh " << builder_name(settings.bvh.builder) << ", " << tree.node_count() << " nodes, " << tree.reference_count() << " refs, SAH cost "
+      << tree.sah_cost() << (tree.cached() ? ", mapped from cache" : "");
+    return s.str();
+  }
+  std::string json() const override {
+    std::stringstream j;
+    j << "\"builder\":\"" << builder_name(settings.bvh.builder) << "\",\"nodes\":" << tree.node_count() << ",\"references\":" << tree.reference_count()
+      << ",\"sah_cost\":" << tree.sah_cost() << ",\"build_cost\":" << tree.build_cost() << ",\"cached\":" << (tree.cached() ? "true" : "false");
+    return j.str();
+  }
+private:
+  accel_settings settings;
+  bvh tree;
+};
+
+class grid_accel : public accelerator { // rebuilt rather than refit, it is cheap to build
+public:
+  const char* name() const override { return "grid"; }
+  void build(const primitive_list& prims, worker_pool* pool) override { cells.build(prims, pool); hash = records_hash(records_of(prims, pool), pool); }
+  bool valid_for(const primitive_list& prims) const override { return cells.valid_for(prims); }
+  hitrecord intersect(const ray& r, const primitive_list& prims, render_stats* stats) const override { return cells.intersect(r, prims, stats); }
+  bool intersect_any(const ray& r, base_type tmax, const primitive_list& prims, render_stats* stats) const override { return cells.intersect_any(r, tmax, prims, stats); }
+  aabb bounds() const override { return cells.bounds(); }
+  size_t memory_usage() const override { return cells.memory_usage(); }
+  uint64_t content_hash() const override { return hash; }
+  std::string summary() const override {
+    std::stringstream s;
+    s << "grid, " << cells.level_count() << " levels, " << cells.cell_count() << " cells, " << cells.reference_count() << " refs";
+    return s.str();
+  }
+  std::string json() const override {
+    std::stringstream j; j << "\"levels\":" << cells.level_count() << ",\"cells\":" << cells.cell_count() << ",\"references\":" << cells.reference_count();
+    return j.str();
+  }
+private:
+  grid cells;
+  uint64_t hash = 0;
+};
+
+// wraps a backend and repeats every query with the linear scan - a disagreement on the hit distance (or on whether
+// anything is hit) counts as a mismatch and the first few are printed. equal distances on different primitives are ties, not errors
+class validating_accel : public accelerator {
+public:
+  validating_accel(std::shared_ptr<accelerator> b) : backend(b) {}
+  const char* name() const override { return backend->name(); }
+  void build(const primitive_list& prims, worker_pool* pool) override { backend->build(prims, pool); }
+  bool valid_for(const primitive_list& prims) const override { return backend->valid_for(prims); }
+  hitrecord intersect(const ray& r, const primitive_list& prims, render_stats* stats) const override {
+    const hitrecord h = backend->intersect(r, prims, stats), reference = linear_accel::scan(r, prims, nullptr);
+    queries++;
+    if(h.dtransit != reference.dtransit) mismatch("intersect", r, h.dtransit, reference.dtransit);
+    return h;
+  }
+  bool intersect_any(const ray& r, base_type tmax, const primitive_list& prims, render_stats* stats) const override {
+    const bool hit = backend->intersect_any(r, tmax, prims, stats), reference = linear_accel::scan_any(r, tmax, prims, nullptr);
+    queries++;
+    if(hit != reference) mismatch("intersect_any", r, hit, reference);
+    return hit;
+  }
+  aabb bounds() const override { return backend->bounds(); }
+  size_t memory_usage() const override { return backend->memory_usage(); }
+  uint64_t content_hash() const override { return backend->content_hash(); }
+  bool refit(const primitive_list& prims, base_type threshold, worker_pool* pool) override { return backend->refit(prims, threshold, pool); }
+  std::string summary() const override {
+    std::stringstream s; s << backend->summary() << ", validated: " << mismatches << " mismatches in " << queries << " queries";
+    return s.str();
+  }
+  std::string json() const override {
+    std::stringstream j; const std::string inner = backend->json();
+    j << inner << (inner.empty() ? "" : ",") << "\"validation\":{\"queries\":" << queries << ",\"mismatches\":" << mismatches << "}";
+    return j.str();
+  }
+  unsigned long long mismatch_count() const { return mismatches; }
+private:
+  std::shared_ptr<accelerator> backend;
+  mutable std::atomic<unsigned long long> queries{0}, mismatches{0};
+  void mismatch(const char* query, const ray& r, base_type got, base_type expected) const {
+    if(mismatches++ < ACCEL_MISMATCH_REPORTS)
+      cerr << backend->name() << " " << query << " mismatch: " << got << " instead of " << expected << " for origin " << r.origin.values[0] << "," << r.origin.values[1]
+           << "," << r.origin.values[2] << " direction " << r.direction.values[0] << "," << r.direction.values[1] << "," << r.direction.values[2] << endl;
+  }
+};
+
+struct accel_backend{ // a registered backend - name, description and how to make one
+  std::string name, help;
+  std::function<std::shared_ptr<accelerator>(const accel_settings&)> make;
+};
+
+inline const std::vector<accel_backend>& accel_backends(){
+  static const std::vector<accel_backend> backends = {
+    { "linear", "no structure, every primitive per ray", [](const accel_settings&){ return std::make_shared<linear_accel>(); } },
+    { "bvh", "bounding volume hierarchy, built as --bvh_build says", [](const accel_settings& s){ return std::make_shared<bvh_accel>(s); } },
+    { "grid", "two level uniform grid, 3D-DDA traversal", [](const accel_settings&){ return std::make_shared<grid_accel>(); } },
+  };
+  return backends;
+}
+
+// a new, unbuilt backend by name - nullptr for an unknown one. validate wraps it in the linear cross-check
+inline std::shared_ptr<accelerator> make_accelerator(const std::string& name, const accel_settings& settings = accel_settings(), bool validate = false){
+  for(const auto& b : accel_backends())
+    if(b.name == name){
+      std::shared_ptr<accelerator> a = b.make(settings);
+      return validate ? std::make_shared<validating_accel>(a) : a;
+    }
+  return nullptr;
+}
+
+#endif
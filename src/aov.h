@@ -0,0 +1,112 @@
+#ifndef AOV_H
+#define AOV_H
+
+#include <cstdio> // fopen
+
+#include "core.h"
+
+// arbitrary output variables - what each pixel's first hits saw, kept alongside the beauty image in the same
+// render pass. depth and normal are averaged over the pixel's samples that hit something, so silhouettes keep the
+// surface's values, albedo and throughput over all of them, and the two indices come from its first sample - the
+// primitive as a contents index, the instance for a hit inside one. written as .pfm, plain floats that keep
+// negative normals and exact indices
+
+enum aov_kind{ AOV_DEPTH, AOV_NORMAL, AOV_ALBEDO, AOV_MATERIAL, AOV_PRIMITIVE, AOV_THROUGHPUT, AOV_COUNT };
+constexpr const char* AOV_NAMES[AOV_COUNT] = { "depth", "normal", "albedo", "material", "primitive", "throughput" };
+constexpr int AOV_UNSET = -2; // index before the first sample writes it, -1 is a miss
+
+inline unsigned aov_bit(aov_kind k){ return 1u << k; }
+
+inline bool parse_aovs(const std::string& list, unsigned& mask){ // "depth,normal,..." - false on an unknown name
+  std::stringstream l(list); std::string name;
+  while(std::getline(l, name, ',')){
+    if(name.empty()) continue;
+    const auto* n = std::find_if(AOV_NAMES, AOV_NAMES + AOV_COUNT, [&](const char* a){ return name == a; });
+    if(n == AOV_NAMES + AOV_COUNT){ cerr << "unknown aov \'" << name << "\'" << endl; return false; }
+    mask |= aov_bit(aov_kind(n - AOV_NAMES));
+  }
+  return true;
+}
+
+struct aov_buffers{ // only the kinds in the mask are allocated
+  unsigned mask = 0;
+  std::vector<vec3> normal, albedo, throughput;
+  std::vector<base_type> depth; // 0 where every sample escaped
+  std::vector<int> material, primitive;
+  std::vector<int> hits;        // camera rays that hit something, per pixel - what depth and normal average over
+
+  void reset(size_t n, unsigned m){
+    mask = m;
+    auto fit = [&](auto& v, aov_kind k, auto zero){ if(has(k)) v.assign(n, zero); else v.clear(); };
+    fit(depth, AOV_DEPTH, base_type(0.)); fit(normal, AOV_NORMAL, vec3(0.)); fit(albedo, AOV_ALBEDO, vec3(0.));
+    fit(material, AOV_MATERIAL, AOV_UNSET); fit(primitive, AOV_PRIMITIVE, AOV_UNSET); fit(throughput, AOV_THROUGHPUT, vec3(0.));
+    if(has(AOV_DEPTH) || has(AOV_NORMAL)) hits.assign(n, 0); else hits.clear();
+  }
+  bool has(aov_kind k) const { return mask & aov_bit(k); }
+  bool active() const { return mask != 0; }
+
+  void clear(size_t i){ // before pixel i is rendered again, over what an earlier render left
+    if(has(AOV_DEPTH)) depth[i] = 0.;
+    if(has(AOV_NORMAL)) normal[i] = vec3(0.);
+    if(has(AOV_ALBEDO)) albedo[i] = vec3(0.);
+    if(has(AOV_THROUGHPUT)) throughput[i] = vec3(0.);
+    if(has(AOV_MATERIAL)) material[i] = AOV_UNSET;
+    if(has(AOV_PRIMITIVE)) primitive[i] = AOV_UNSET;
+    if(!hits.empty()) hits[i] = 0;
+  }
+  void add_hit(size_t i, const hitrecord& h){ // straight after the camera ray's query, for misses too
+    const bool hit = h.dtransit < DMAX_TRAVEL;
+    if(hit && !hits.empty()) hits[i]++;
+    if(hit && has(AOV_DEPTH)) depth[i] += h.dtransit;
+    if(hit && has(AOV_NORMAL)) normal[i] += normalize(h.normal);
+    if(has(AOV_MATERIAL) && material[i] == AOV_UNSET) material[i] = hit ? h.material_index : -1;
+    if(has(AOV_PRIMITIVE) && primitive[i] == AOV_UNSET) primitive[i] = hit ? (h.instance_index < 0 ? h.primitive_index : h.instance_index) : -1;
+  }
+  void add_shading(size_t i, const vec3& color, const vec3& weight){ // the first surface's color, and the throughput it leaves
+    if(has(AOV_ALBEDO)) albedo[i] += color;
+    if(has(AOV_THROUGHPUT)) throughput[i] += weight;
+  }
+  void average(size_t i, int samples){
+    const base_type s = 1. / samples, surface = hits.empty() ? 0. : 1. / std::max(hits[i], 1);
+    if(has(AOV_DEPTH)) depth[i] *= surface;
+    if(has(AOV_NORMAL)) normal[i] *= surface;
+    if(has(AOV_ALBEDO)) albedo[i] *= s;
+    if(has(AOV_THROUGHPUT)) throughput[i] *= s;
+  }
+
+  // <base>_<name>.pfm for every kind in the write mask - false if a file could not be written
+  bool write(const std::string& base, unsigned write_mask, int w, int h) const {
+    bool ok = true;
+    for(int k = 0; k < AOV_COUNT; k++){
+      if(!(write_mask & mask & aov_bit(aov_kind(k)))) continue;
+      const int channels = (k == AOV_NORMAL || k == AOV_ALBEDO || k == AOV_THROUGHPUT) ? 3 : 1;
+      std::vector<float> out(size_t(w) * h * channels);
+      for(int y = 0; y < h; y++) // pfm rows run bottom to top
+      for(int x = 0; x < w; x++){
+        const size_t i = size_t(y)*w + x; float* o = &out[(size_t(h-1-y)*w + x) * channels];
+        switch(k){
+          case AOV_DEPTH:      o[0] = depth[i]; break;
+          case AOV_MATERIAL:   o[0] = material[i]; break;
+          case AOV_PRIMITIVE:  o[0] = primitive[i]; break;
+          case AOV_NORMAL:     for(int c = 0; c < 3; c++) o[c] = normal[i].values[c]; break;
+          case AOV_ALBEDO:     for(int c = 0; c < 3; c++) o[c] = albedo[i].values[c]; break;
+          case AOV_THROUGHPUT: for(int c = 0; c < 3; c++) o[c] = throughput[i].values[c]; break;
+        }
+      }
+      const std::string filename = base + "_" + AOV_NAMES[k] + ".pfm";
+      if(!write_pfm(filename, out, w, h, channels)){ cerr << "can't write \'" << filename << "\'" << endl; ok = false; continue; }
+      cout << "AOV \'" << filename << "\'" << endl;
+    }
+    return ok;
+  }
+  static bool write_pfm(const std::string& filename, const std::vector<float>& data, int w, int h, int channels){
+    FILE* f = fopen(filename.c_str(), "wb");
+    if(!f) return false;
+    const uint16_t probe = 1; const bool little = *reinterpret_cast<const uint8_t*>(&probe) == 1;
+    fprintf(f, "%s\n%d %d\n%s\n", channels == 3 ? "PF" : "Pf", w, h, little ? "-1.0" : "1.0"); // negative scale is little endian
+    const bool ok = fwrite(data.data(), sizeof(float), data.size(), f) == data.size();
+    return fclose(f) == 0 && ok;
+  }
+};
+
+#endif
@@ -0,0 +1,109 @@
+// deterministic benchmark suite - fixed seed scenes and cameras, repeated runs, compared against a baseline
+//   usage: render_bench [--runs n] [--baseline file] [--save-baseline file] [--threshold fraction] [--only name] [--accel bvh|grid]
+
+#include <fstream>
+#include <map>
+
+// geometry, camera and the tile renderer
+#include "renderer.h"
+
+// image output - renderer.h has the declarations, this compiles in the implementation
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+struct bench_scene{ // one canonical scene - image size and spp are scaled down as the primitive count goes up
+  std::string name;
+  long long pairs; // triangle+sphere pairs, so primitive count is twice this
+  int xdim, ydim, nsamples;
+};
+
+const std::vector<bench_scene> canonical_scenes = {
+  { "prims-100",      50, 320, 180, 4 },
+  { "prims-10k",    5000,  48,  27, 1 },
+  { "prims-1m",   500000,   8,   8, 1 },
+};
+
+constexpr unsigned long long BENCH_SEED = 0xA1BA7105EULL;
+const vec3 BENCH_CAMERA = vec3(1.6, 0.8, 2.1);
+
+bool load_baseline(const std::string& path, std::map<std::string, double>& baseline){ // "name median_rays_per_sec" per line
+  std::ifstream f(path); std::string line;
+  if(!f){ cerr << "can't open baseline \'" << path << "\' - write one with --save-baseline (make bench-baseline)" << endl; return false; }
+  while(std::getline(f, line)){
+    if(line.empty() || line[0] == '#') continue;
+    std::stringstream l(line); std::string name; double value;
+    if(l >> name >> value) baseline[name] = value;
+  }
+  return true;
+}
+
+int main(int argc, char const *argv[]){
+  int runs = 5;
+  double threshold = 0.1; // allowed fractional drop in median rays/sec before it counts as a regression
+  std::string baseline_path, save_path, only, accel = "bvh";
+  for (int i = 1; i < argc; i++){ // every option takes a value
+    const std::string arg = argv[i];
+    if(i+1 >= argc){ cerr << "missing value for \'" << arg << "\'" << endl; return 2; }
+    try {
+      if(arg == "--runs")               runs = std::max(1, std::stoi(argv[++i]));
+      else if(arg == "--threshold")     threshold = std::stod(argv[++i]);
+      else if(arg == "--baseline")      baseline_path = argv[++i];
+      else if(arg == "--save-baseline") save_path = argv[++i];
+      else if(arg == "--only")          only = argv[++i];
+      else if(arg == "--accel")         accel = argv[++i];
+      else { cerr << "unknown option \'" << arg << "\'" << endl; return 2; }
+    } catch(const std::exception& e) {
+      cerr << "bad value \'" << argv[i] << "\' for \'" << arg << "\'" << endl; return 2;
+    }
+  }
+  std::map<std::string, double> baseline;
+  if(!baseline_path.empty() && !load_baseline(baseline_path, baseline)) return 2;
+  std::stringstream saved; saved << "# render_bench baseline - scene median_rays_per_sec" << endl;
+
+  cout << std::left << std::setw(16) << "scene" << std::right << std::setw(10) << "prims" << std::setw(10) << "res" << std::setw(5) << "spp"
+       << std::setw(14) << "median rays/s" << std::setw(14) << "min" << std::setw(14) << "max" << std::setw(9) << "spread"
+       << std::setw(14) << "baseline" << std::setw(9) << "delta" << endl;
+  bool regressed = false;
+  for(const auto& b : canonical_scenes){
+    if(!only.empty() && b.name != only) continue;
+    render_settings rs;
+    rs.xdim = b.xdim; rs.ydim = b.ydim; rs.nsamples = b.nsamples; rs.primitives = b.pairs;
+    rs.seed = BENCH_SEED; rs.random_camera = false; rs.camera_position = BENCH_CAMERA; rs.quiet = true; rs.accel = accel;
+    const std::string name = (accel == "bvh") ? b.name : b.name + "/" + accel; // other backends keep their own baseline entries
+
+    std::vector<double> rays_per_sec;
+    for(int run = 0; run < runs; run++){
+      renderer r(rs);
+      if(!r.scene_ok) return 1;
+      r.render();
+      rays_per_sec.push_back(r.totals().total_rays() / std::max(r.render_phase_time().wall, 1e-9));
+    }
+    std::sort(rays_per_sec.begin(), rays_per_sec.end());
+    const size_t n = rays_per_sec.size();
+    const double median = (n % 2) ? rays_per_sec[n/2] : 0.5*(rays_per_sec[n/2-1] + rays_per_sec[n/2]);
+    const double spread = (rays_per_sec.back() - rays_per_sec.front()) / median;
+
+    std::stringstream res; res << b.xdim << "x" << b.ydim;
+    cout << std::left << std::setw(16) << name << std::right << std::setw(10) << 2*b.pairs << std::setw(10) << res.str() << std::setw(5) << b.nsamples
+         << std::fixed << std::setprecision(0) << std::setw(14) << median << std::setw(14) << rays_per_sec.front() << std::setw(14) << rays_per_sec.back()
+         << std::setprecision(1) << std::setw(8) << 100.*spread << "%";
+    auto it = baseline.find(name);
+    if(it != baseline.end()){
+      const double delta = median / it->second - 1.;
+      cout << std::setprecision(0) << std::setw(14) << it->second << std::setprecision(1) << std::setw(8) << std::showpos << 100.*delta << "%" << std::noshowpos;
+      if(delta < -threshold){ cout << "  REGRESSION"; regressed = true; }
+    } else {
+      cout << std::setw(14) << "-" << std::setw(9) << "-";
+    }
+    cout << std::defaultfloat << std::setprecision(6) << endl;
+    saved << name << " " << std::fixed << std::setprecision(0) << median << endl;
+  }
+
+  if(!save_path.empty()){
+    std::ofstream f(save_path); f << saved.str();
+    cout << "Baseline written to \'" << save_path << "\'" << endl;
+  }
+  if(regressed)
+    cout << "Median rays/sec dropped more than " << 100.*threshold << "% below the baseline" << endl;
+  return regressed ? 1 : 0;
+}
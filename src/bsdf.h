@@ -0,0 +1,78 @@
+#ifndef BSDF_H
+#define BSDF_H
+
+#include "core.h"
+
+// scattering at a hit, per material - sample() picks an outgoing direction, eval() and pdf() give the cosine
+// weighted bsdf and the sampling density for any direction, so a strategy that picked the direction some
+// other way (a light sample) can be weighed against this one. directions point away from the surface
+
+// orthonormal basis around a unit vector, without branches or a normalize (Duff et al. 2017)
+inline void orthonormal_basis(const vec3& n, vec3& b1, vec3& b2){
+  const base_type sign = std::copysign(1., n.values[2]);
+  const base_type a = -1. / (sign + n.values[2]);
+  const base_type b = n.values[0] * n.values[1] * a;
+  b1 = vec3(1. + sign * n.values[0] * n.values[0] * a, sign * b, -sign * n.values[0]);
+  b2 = vec3(b, sign + n.values[1] * n.values[1] * a, -n.values[1]);
+}
+
+struct bsdf_sample{
+  vec3 direction;   // unit, leaving the surface
+  vec3 weight;     // bsdf * cosine / pdf - what throughput is multiplied by
+  base_type pdf = 0.; // solid angle density, 0 for a specular direction
+  bool specular = false;
+};
+
+class bsdf{
+public:
+  // materials 0 (palette diffuse), 1 (emissive, scattering like white diffuse), 2 (mirror) and 3 (grey diffuse).
+  // anything else, or a miss, has no bsdf and ends the path
+  bsdf(const hitrecord& h) : n(normalize(h.normal)) { // rays leave on the side the normal points, as they always have
+    switch(h.material_index){
+      case 0: reflectance = palette(h.primitive_index*PALETTE_SCALAR); break;
+      case 1: reflectance = vec3(1.); emissive = true; // uv colored on the front, palette colored behind
+              emission = h.front ? BRIGHTNESS_SCALAR * vec3(h.uv.values[0], h.uv.values[1], 1-h.uv.values[0]-h.uv.values[1])
+                                 : palette(h.primitive_index*PALETTE_SCALAR)*BRIGHTNESS_SCALAR; break;
+      case 2: reflectance = vec3(0.89); mirror = true; break;
+      case 3: reflectance = vec3(0.999); break;
+      default: valid = false;
+    }
+    if(h.dtransit == DMAX_TRAVEL) valid = false;
+  }
+  bool scatters() const { return valid; }
+  bool specular() const { return mirror; }
+  vec3 emitted() const { return emission; }
+  vec3 albedo() const { return reflectance; }
+  vec3 normal() const { return n; }
+  vec3 color() const { return emissive ? emission / BRIGHTNESS_SCALAR : reflectance; } // what the aovs and denoiser see
+
+  vec3 eval(const vec3& wi) const { // bsdf * cosine toward wi, 0 for the mirror - only its own sample can find it
+    if(!valid || mirror) return vec3(0.);
+    return reflectance * (std::max(dot(n, wi), 0.) / pi);
+  }
+  base_type pdf(const vec3& wi) const {
+    if(!valid || mirror) return 0.;
+    return std::max(dot(n, wi), 0.) / pi;
+  }
+  // d is the incoming ray's direction. the diffuse lobe is cosine sampled, so its weight is just the reflectance
+  bsdf_sample sample(const vec3& d, std::shared_ptr<std::mt19937_64> gen) const {
+    bsdf_sample s;
+    if(!valid) return s;
+    if(mirror){
+      s.direction = normalize(reflect(d, n)); s.weight = reflectance; s.specular = true;
+      return s;
+    }
+    const base_type u1 = rng(gen), u2 = rng(gen);
+    const base_type r = std::sqrt(u1), phi = 2. * pi * u2, z = std::sqrt(std::max(1. - u1, 0.));
+    vec3 b1, b2; orthonormal_basis(n, b1, b2);
+    s.direction = normalize(b1 * (r * std::cos(phi)) + b2 * (r * std::sin(phi)) + n * z);
+    s.pdf = z / pi; s.weight = reflectance;
+    return s;
+  }
+private:
+  vec3 n; // unit normal
+  vec3 reflectance, emission;
+  bool mirror = false, emissive = false, valid = true;
+};
+
+#endif
@@ -0,0 +1,701 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <array>
+#include <cerrno>    // EEXIST
+#include <numeric>  // iota
+
+#include "mesh.h" // mapped_file
+
+// bounding volume hierarchy over the scene primitives - binned SAH or parallel morton code (LBVH/HLBVH) builds,
+// plus an on disk cache of the built tree keyed by a hash of the primitive data, so later runs over the same
+// geometry only map a file
+
+struct bvh_node{ // interior: count 0, children at left_first and left_first+1 - leaf: indices [left_first, left_first+count)
+  aabb box;
+  uint32_t left_first = 0;
+  uint32_t count = 0;
+};
+
+struct bvh_cache_header{ // .ambvh layout: header, primitive records, nodes, primitive indices
+  char magic[8];
+  uint64_t scene_hash;
+  uint64_t primitive_count;
+  uint64_t node_count;
+  uint64_t index_count; // more than primitive_count when spatial splits put a primitive in several leaves
+  double build_cost;    // sah_cost() of the tree as built, so mapping it doesn't walk every node
+  uint64_t reserved[2];
+};
+constexpr char BVH_CACHE_MAGIC[8] = {'A','M','B','V','H','0','0','5'}; // bump when the layout or the builder changes
+
+constexpr int BVH_BINS = 16;       // SAH candidate planes per axis
+constexpr int BVH_MAX_LEAF = 4;   // leaves are only forced to split above this
+constexpr int BVH_MAX_DEPTH = 48; // past this the build falls back to median splits, keeps traversal stacks bounded
+constexpr int BVH_STACK = 128;   // traversal stack entries
+constexpr int MORTON_BITS = 10;         // per axis, 30 bit codes
+constexpr int LBVH_CLUSTER_BITS = 15;  // leading code bits shared by a cluster - subtrees below are built in parallel
+constexpr size_t HASH_BLOCK = 1 << 16; // records hashed per task, fixed so the hash doesn't depend on the thread count
+
+using primitive_list = std::vector<std::shared_ptr<primitive>>;
+
+// sah: binned SAH, single threaded - lbvh: morton order, split on code bits - hlbvh: lbvh clusters, binned SAH over
+// the top - sbvh: binned SAH with spatial splits, clipping primitives that straddle the plane, single threaded
+enum class bvh_builder { sah, lbvh, hlbvh, sbvh };
+inline const char* builder_name(const bvh_builder b){
+  return b == bvh_builder::sah ? "sah" : b == bvh_builder::lbvh ? "lbvh" : b == bvh_builder::hlbvh ? "hlbvh" : "sbvh";
+}
+inline bool parse_builder(const std::string& name, bvh_builder& b){
+  for(bvh_builder candidate : {bvh_builder::sah, bvh_builder::lbvh, bvh_builder::hlbvh, bvh_builder::sbvh})
+    if(name == builder_name(candidate)){ b = candidate; return true; }
+  return false;
+}
+
+struct bvh_params{ // how a tree is built - all of it goes into the cache key
+  bvh_builder builder = bvh_builder::sah;
+  base_type split_alpha = 1e-5; // sbvh: spatial splits are only tried where the object split children overlap by more than this, relative to the root area
+  base_type split_budget = 1.; // sbvh: duplicated references allowed, as a fraction of the primitive count
+  std::string key() const {
+    std::stringstream k; k << builder_name(builder);
+    if(builder == bvh_builder::sbvh) k << " " << split_alpha << " " << split_budget;
+    return k.str();
+  }
+};
+
+// box of the part of triangle p inside the slab lo <= x[axis] <= hi
+inline aabb clip_triangle(const vec3 p[3], const int axis, const base_type lo, const base_type hi){
+  aabb b;
+  for(int i = 0; i < 3; i++){
+    const vec3& a = p[i]; const vec3& c = p[(i+1)%3];
+    if(a.values[axis] >= lo && a.values[axis] <= hi) b.grow(a);
+    for(const base_type plane : {lo, hi})
+      if((a.values[axis] - plane) * (c.values[axis] - plane) < 0.){ // edge crosses the plane
+        vec3 x = a + (c - a) * ((plane - a.values[axis]) / (c.values[axis] - a.values[axis]));
+        x.values[axis] = plane;
+        b.grow(x);
+      }
+  }
+  return b;
+}
+inline aabb intersection(const aabb& a, const aabb& b){
+  aabb r;
+  for(int k = 0; k < 3; k++){ r.lo.values[k] = std::max(a.lo.values[k], b.lo.values[k]); r.hi.values[k] = std::min(a.hi.values[k], b.hi.values[k]); }
+  for(int k = 0; k < 3; k++) if(r.lo.values[k] > r.hi.values[k]) return aabb();
+  return r;
+}
+
+// on the pool if there is one, inline otherwise
+inline void parallel_for(worker_pool* pool, size_t n, const std::function<void(size_t, size_t, int)>& f, size_t grain = 1){
+  if(pool) pool->parallel_for(n, f, grain); else if(n) f(0, n, 0);
+}
+
+inline uint32_t expand_bits(uint32_t v){ // 10 bits to every third of 30
+  v = (v * 0x00010001u) & 0xFF0000FFu;
+  v = (v * 0x00000101u) & 0x0F00F00Fu;
+  v = (v * 0x00000011u) & 0xC30C30C3u;
+  v = (v * 0x00000005u) & 0x49249249u;
+  return v;
+}
+
+// stable LSD radix sort of keys, carrying values along - 8 bit digits, each worker counts and scatters its own slice
+inline void radix_sort(std::vector<uint32_t>& keys, std::vector<uint32_t>& values, worker_pool* pool){
+  const size_t n = keys.size();
+  const int workers = pool ? pool->size() : 1;
+  std::vector<uint32_t> key_out(n), value_out(n);
+  std::vector<std::array<size_t, 256>> offsets(workers);
+  auto slice = [&](int id){ return std::make_pair(n * id / workers, n * (id+1) / workers); };
+  auto each_worker = [&](const std::function<void(int)>& f){ if(pool) pool->run(f); else f(0); };
+  for(int shift = 0; shift < 32; shift += 8){
+    each_worker([&](int id){
+      offsets[id].fill(0);
+      for(size_t i = slice(id).first; i < slice(id).second; i++) offsets[id][(keys[i] >> shift) & 0xFF]++;
+    });
+    size_t sum = 0; // digit major, then worker - keeps the order stable
+    for(int d = 0; d < 256; d++)
+      for(int id = 0; id < workers; id++){ const size_t c = offsets[id][d]; offsets[id][d] = sum; sum += c; }
+    each_worker([&](int id){
+      for(size_t i = slice(id).first; i < slice(id).second; i++){
+        const size_t to = offsets[id][(keys[i] >> shift) & 0xFF]++;
+        key_out[to] = keys[i]; value_out[to] = values[i];
+      }
+    });
+    keys.swap(key_out); values.swap(value_out);
+  }
+}
+
+inline std::vector<primitive_record> records_of(const primitive_list& prims, worker_pool* pool = nullptr){
+  std::vector<primitive_record> records(prims.size());
+  parallel_for(pool, prims.size(), [&](size_t b, size_t e, int){ for(size_t i = b; i < e; i++) records[i] = prims[i]->record(); }, 1024);
+  return records;
+}
+inline uint64_t word_hash(const primitive_record* records, size_t count){ // fnv-1a a word rather than a byte at a time
+  static_assert(sizeof(primitive_record) % sizeof(uint64_t) == 0, "records hash as whole words");
+  const size_t words = count * sizeof(primitive_record) / sizeof(uint64_t);
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(records);
+  uint64_t h = 14695981039346656037ull;
+  for(size_t i = 0; i < words; i++){ uint64_t w; std::memcpy(&w, p + i*sizeof(w), sizeof(w)); h ^= w; h *= 1099511628211ull; h ^= h >> 29; }
+  return h;
+}
+// identifies the primitive data - hashed in fixed size blocks so the result doesn't depend on the thread count
+inline uint64_t records_hash(const std::vector<primitive_record>& records, worker_pool* pool = nullptr){
+  const size_t n = records.size();
+  std::vector<uint64_t> block_hash((n + HASH_BLOCK - 1) / HASH_BLOCK);
+  parallel_for(pool, block_hash.size(), [&](size_t b, size_t e, int){
+    for(size_t i = b; i < e; i++)
+      block_hash[i] = word_hash(&records[i*HASH_BLOCK], std::min(HASH_BLOCK, n - i*HASH_BLOCK));
+  });
+  return fnv1a(block_hash.data(), block_hash.size() * sizeof(uint64_t), fnv1a(BVH_CACHE_MAGIC, 8));
+}
+
+class bvh{
+public:
+  // builds over prims, in parallel on the pool if one is given (the sah and sbvh tree builds are single threaded).
+  // with a cache_dir, a tree cached there for identical primitive data and parameters is mapped instead,
+  // and a freshly built tree is written out for next time
+  void build(const primitive_list& prims, const std::string& cache_dir = "", const bvh_params& params = bvh_params(), worker_pool* pool = nullptr){
+    clear();
+    if(prims.empty()) return;
+    const size_t n = prims.size();
+    const std::vector<primitive_record> records = records_of(prims, pool);
+    hash = records_hash(records, pool);
+    const std::string name = params.key();
+    const uint64_t key = fnv1a(name.data(), name.size(), hash); // the same primitives make a different tree per builder
+    std::stringstream path; path << cache_dir << "/" << std::hex << std::setw(16) << std::setfill('0') << key << ".ambvh";
+    if(!cache_dir.empty() && map_cache(path.str(), key, records, pool)){
+      build_packets(prims, pool);
+      return;
+    }
+
+    std::vector<aabb> boxes(n);
+    parallel_for(pool, n, [&](size_t b, size_t e, int){ for(size_t i = b; i < e; i++) boxes[i] = prims[i]->bounds(); }, 1024);
+    if(params.builder == bvh_builder::sah){
+      index_storage.resize(n); std::iota(index_storage.begin(), index_storage.end(), 0u);
+      build_sah(boxes, index_storage, node_storage, BVH_MAX_LEAF);
+    } else if(params.builder == bvh_builder::sbvh)
+      build_sbvh(boxes, records, params);
+    else
+      build_lbvh(boxes, params.builder == bvh_builder::hlbvh, pool);
+    node_total = node_storage.size(); primitive_total = n; index_total = index_storage.size();
+    build_packets(prims, pool);
+    built_cost = sah_cost();
+    if(!cache_dir.empty() && !save_cache(cache_dir, path.str(), key, records))
+      cerr << "couldn't write bvh cache \'" << path.str() << "\'" << endl;
+  }
+  void clear(){
+    node_storage.clear(); index_storage.clear(); map.reset(); levels.clear(); level_starts.clear(); packets.clear(); node_packet.clear();
+    mapped_nodes = nullptr; mapped_indices = nullptr; node_total = 0; primitive_total = 0; index_total = 0; hash = 0; built_cost = 0.;
+  }
+
+  // after primitives have moved in place (same list, same order) - recomputes every box bottom up, one tree
+  // level at a time with the nodes of a level in parallel. the shape of the tree is kept, so it gets worse
+  // as things move: sah_cost() against build_cost() says by how much
+  void refit(const primitive_list& prims, worker_pool* pool = nullptr){
+    if(map){ // a mapped tree is read only, take a copy first
+      node_storage.assign(mapped_nodes, mapped_nodes + node_total); index_storage.assign(mapped_indices, mapped_indices + index_total);
+      map.reset(); mapped_nodes = nullptr; mapped_indices = nullptr;
+    }
+    if(levels.empty()){ // breadth first, level by level
+      levels.push_back(0); level_starts = {0, 1};
+      for(size_t l = 0; level_starts[l] < level_starts[l+1]; l++){
+        for(size_t i = level_starts[l]; i < level_starts[l+1]; i++){
+          const bvh_node& nd = node_storage[levels[i]];
+          if(nd.count == 0){ levels.push_back(nd.left_first); levels.push_back(nd.left_first+1); }
+        }
+        level_starts.push_back(levels.size());
+      }
+    }
+    for(size_t l = level_starts.size()-1; l-- > 0; )
+      parallel_for(pool, level_starts[l+1] - level_starts[l], [&](size_t b, size_t e, int){
+        for(size_t i = level_starts[l] + b; i < level_starts[l] + e; i++){
+          bvh_node& nd = node_storage[levels[i]];
+          nd.box = aabb();
+          if(nd.count)
+            for(uint32_t k = nd.left_first; k < nd.left_first + nd.count; k++) nd.box.grow(prims[index_storage[k]]->bounds());
+          else {
+            nd.box.grow(node_storage[nd.left_first].box); nd.box.grow(node_storage[nd.left_first+1].box);
+          }
+        }
+      }, 256);
+    build_packets(prims, pool); // the triangles moved with the boxes
+  }
+  // expected cost of a random ray that hits the root, in intersection tests, with a node visit counting as one
+  base_type sah_cost() const {
+    const bvh_node* nodes = node_data();
+    if(!node_total) return 0.;
+    base_type cost = 0.;
+    for(size_t i = 0; i < node_total; i++) cost += nodes[i].box.surface_area() * (nodes[i].count ? nodes[i].count : 1);
+    return cost / std::max(nodes[0].box.surface_area(), HIT_EPSILON);
+  }
+  base_type build_cost() const { return built_cost; } // sah_cost() when it was built
+  bool valid_for(const primitive_list& prims) const { return node_total && primitive_total == prims.size(); }
+  bool cached() const { return map != nullptr; }
+  size_t node_count() const { return node_total; }
+  size_t reference_count() const { return index_total; } // leaf references, primitives split by the sbvh count more than once
+  uint64_t content_hash() const { return hash; } // of the primitives it was built over
+  aabb bounds() const { return node_total ? node_data()[0].box : aabb(); }
+
+  hitrecord intersect(const ray& r, const primitive_list& prims, render_stats* stats=nullptr) const {
+    const bvh_node* nodes = node_data(); const uint32_t* indices = index_data();
+    hitrecord h;
+    base_type current_min = DMAX_TRAVEL;
+    const vec3 inv(1./r.direction.values[0], 1./r.direction.values[1], 1./r.direction.values[2]);
+    struct entry{ uint32_t node; base_type t; };
+    entry stack[BVH_STACK]; int sp = 0;
+    if(nodes[0].box.hit(r.origin, inv, current_min) < DMAX_TRAVEL) stack[sp++] = {0, 0.};
+    while(sp){
+      const entry e = stack[--sp];
+      if(e.t >= current_min) continue; // something closer was found since this was pushed
+      const bvh_node& n = nodes[e.node];
+      if(n.count){
+        if(stats) stats->intersection_tests += n.count;
+        const int32_t packet = node_packet[e.node];
+        base_type t[TRIANGLE_LANES];
+        if(packet >= 0) packets[packet].intersect(r, t);
+        for(uint32_t k = 0; k < n.count; k++){
+          const uint32_t i = indices[n.left_first + k];
+          if(packet >= 0 && (packets[packet].triangles >> k & 1)){ // distance from the packet, the full record only for a closer hit
+            if(t[k] < DMAX_TRAVEL && t[k] > 0. && t[k] < current_min){
+              current_min = t[k];
+              h = prims[i]->intersect(r); h.primitive_index = i;
+            }
+            continue;
+          }
+          hitrecord temp = prims[i]->intersect(r);
+          (temp.instance_index < 0 ? temp.primitive_index : temp.instance_index) = i;
+          if(temp.dtransit < DMAX_TRAVEL && temp.dtransit > 0. && temp.dtransit < current_min){
+            current_min = temp.dtransit;
+            h = temp;
+          }
+        }
+      } else { // near child goes on top
+        base_type t0 = nodes[n.left_first].box.hit(r.origin, inv, current_min);
+        base_type t1 = nodes[n.left_first+1].box.hit(r.origin, inv, current_min);
+        uint32_t c0 = n.left_first, c1 = n.left_first+1;
+        if(t1 < t0){ std::swap(t0, t1); std::swap(c0, c1); }
+        if(t1 < DMAX_TRAVEL) stack[sp++] = {c1, t1};
+        if(t0 < DMAX_TRAVEL) stack[sp++] = {c0, t0};
+      }
+    }
+    return h;
+  }
+  // any hit in (0, tmax) - for occlusion, so no ordering, and it stops at the first one
+  bool intersect_any(const ray& r, const base_type tmax, const primitive_list& prims, render_stats* stats=nullptr) const {
+    const bvh_node* nodes = node_data(); const uint32_t* indices = index_data();
+    const vec3 inv(1./r.direction.values[0], 1./r.direction.values[1], 1./r.direction.values[2]);
+    uint32_t stack[BVH_STACK]; int sp = 0;
+    if(nodes[0].box.hit(r.origin, inv, tmax) < DMAX_TRAVEL) stack[sp++] = 0;
+    while(sp){
+      const bvh_node& n = nodes[stack[--sp]];
+      if(n.count){
+        const int32_t packet = node_packet[&n - nodes];
+        base_type t[TRIANGLE_LANES];
+        if(packet >= 0) packets[packet].intersect(r, t);
+        for(uint32_t k = 0; k < n.count; k++){
+          if(stats) stats->intersection_tests++;
+          const base_type d = (packet >= 0 && (packets[packet].triangles >> k & 1)) ? t[k] : prims[indices[n.left_first + k]]->intersect(r).dtransit;
+          if(d > 0. && d < tmax) return true;
+        }
+      } else {
+        if(nodes[n.left_first].box.hit(r.origin, inv, tmax) < DMAX_TRAVEL) stack[sp++] = n.left_first;
+        if(nodes[n.left_first+1].box.hit(r.origin, inv, tmax) < DMAX_TRAVEL) stack[sp++] = n.left_first+1;
+      }
+    }
+    return false;
+  }
+  size_t memory_usage() const { // mapped or not
+    return node_total * sizeof(bvh_node) + index_total * sizeof(uint32_t) + packets.size() * sizeof(triangle4) + node_packet.size() * sizeof(int32_t);
+  }
+
+private:
+  std::vector<bvh_node> node_storage; std::vector<uint32_t> index_storage; // a fresh build
+  std::shared_ptr<mapped_file> map;                                        // or a mapped cache file
+  const bvh_node* mapped_nodes = nullptr; const uint32_t* mapped_indices = nullptr;
+  size_t node_total = 0, primitive_total = 0, index_total = 0;
+  uint64_t hash = 0;
+  base_type built_cost = 0.;
+  std::vector<uint32_t> levels; std::vector<size_t> level_starts; // node indices by depth, for refitting
+  std::vector<triangle4> packets; std::vector<int32_t> node_packet; // per node, the leaf's triangles in SoA form or -1
+  const bvh_node* node_data() const { return map ? mapped_nodes : node_storage.data(); }
+  const uint32_t* index_data() const { return map ? mapped_indices : index_storage.data(); }
+
+  // binned SAH over the items in order, which it reorders - leaves cover ranges of order, with at most max_leaf
+  // items unless SAH prefers a split. children are allocated in pairs
+  static void build_sah(const std::vector<aabb>& boxes, std::vector<uint32_t>& order, std::vector<bvh_node>& out, const uint32_t max_leaf){
+    const uint32_t n = uint32_t(order.size());
+    std::vector<vec3> centroids(boxes.size());
+    for(uint32_t i : order) centroids[i] = boxes[i].centroid();
+    out.assign(1, bvh_node{});
+    out.reserve(2*std::max(n, 1u));
+    out[0].count = n;
+
+    struct task{ uint32_t node; int depth; };
+    std::vector<task> work{{0, 0}};
+    while(!work.empty()){
+      const task t = work.back(); work.pop_back();
+      bvh_node& node = out[t.node];
+      const uint32_t first = node.left_first, count = node.count;
+      aabb centroid_bounds;
+      for(uint32_t i = first; i < first + count; i++){ node.box.grow(boxes[order[i]]); centroid_bounds.grow(centroids[order[i]]); }
+      if(count <= 1) continue;
+
+      // binned SAH - cost relative to one intersection test, with the node visit costing the same
+      int best_axis = -1, best_bin = 0; base_type best_cost = DMAX_TRAVEL;
+      const base_type parent_area = std::max(node.box.surface_area(), HIT_EPSILON);
+      for(int a = 0; a < 3 && t.depth < BVH_MAX_DEPTH; a++){
+        const base_type lo = centroid_bounds.lo.values[a], extent = centroid_bounds.hi.values[a] - lo;
+        if(extent <= 0.) continue;
+        aabb bin_box[BVH_BINS]; uint32_t bin_count[BVH_BINS] = {};
+        for(uint32_t i = first; i < first + count; i++){
+          const int b = std::min(BVH_BINS-1, int(BVH_BINS * (centroids[order[i]].values[a] - lo) / extent));
+          bin_box[b].grow(boxes[order[i]]); bin_count[b]++;
+        }
+        base_type right_area[BVH_BINS]; uint32_t right_count[BVH_BINS];
+        aabb acc; uint32_t c = 0;
+        for(int b = BVH_BINS-1; b > 0; b--){ acc.grow(bin_box[b]); c += bin_count[b]; right_area[b] = acc.surface_area(); right_count[b] = c; }
+        acc = aabb(); c = 0;
+        for(int b = 1; b < BVH_BINS; b++){ // split between bin b-1 and b
+          acc.grow(bin_box[b-1]); c += bin_count[b-1];
+          if(c == 0 || right_count[b] == 0) continue;
+          const base_type cost = 1. + (acc.surface_area()*c + right_area[b]*right_count[b]) / parent_area;
+          if(cost < best_cost){ best_cost = cost; best_axis = a; best_bin = b; }
+        }
+      }
+      if(count <= max_leaf && best_cost >= base_type(count)) continue; // leaf is cheaper
+
+      uint32_t* begin = &order[first]; uint32_t* end = begin + count; uint32_t* mid;
+      if(best_axis >= 0){
+        const int a = best_axis;
+        const base_type lo = centroid_bounds.lo.values[a], extent = centroid_bounds.hi.values[a] - lo;
+        mid = std::partition(begin, end, [&](uint32_t i){
+          return std::min(BVH_BINS-1, int(BVH_BINS * (centroids[i].values[a] - lo) / extent)) < best_bin; });
+      } else { // deep, or every centroid in one place - split at the median of the widest axis
+        const vec3 d = centroid_bounds.hi - centroid_bounds.lo;
+        const int a = (d.values[0] > d.values[1] && d.values[0] > d.values[2]) ? 0 : (d.values[1] > d.values[2]) ? 1 : 2;
+        mid = begin + count/2;
+        std::nth_element(begin, mid, end, [&](uint32_t i, uint32_t j){ return centroids[i].values[a] < centroids[j].values[a]; });
+      }
+      const uint32_t left_count = uint32_t(mid - begin), children = uint32_t(out.size());
+      node.left_first = children; node.count = 0; // node is not touched past here, push_back stays inside the reservation
+      out.push_back(bvh_node{aabb(), first, left_count});
+      out.push_back(bvh_node{aabb(), first + left_count, count - left_count});
+      work.push_back({children, t.depth+1});
+      work.push_back({children+1, t.depth+1});
+    }
+  }
+
+  // items [first, last) in morton order, under out[node] - split where the highest differing code bit flips,
+  // at the middle once the codes are equal. leaves hold up to max_leaf items
+  template <typename BOX>
+  static void emit_morton(std::vector<bvh_node>& out, const uint32_t node, const uint32_t* codes, const uint32_t first, const uint32_t last,
+                          const uint32_t max_leaf, const BOX& box_of){
+    if(last - first <= max_leaf){
+      out[node].left_first = first; out[node].count = last - first;
+      for(uint32_t i = first; i < last; i++) out[node].box.grow(box_of(i));
+      return;
+    }
+    uint32_t split = first + (last - first) / 2;
+    if(codes[first] != codes[last-1]){
+      const int bit = 31 - __builtin_clz(codes[first] ^ codes[last-1]);
+      split = uint32_t(std::partition_point(codes + first, codes + last, [bit](uint32_t c){ return !((c >> bit) & 1); }) - codes);
+    }
+    const uint32_t children = uint32_t(out.size());
+    out.emplace_back(); out.emplace_back();
+    out[node].left_first = children; out[node].count = 0;
+    emit_morton(out, children, codes, first, split, max_leaf, box_of);
+    emit_morton(out, children+1, codes, split, last, max_leaf, box_of);
+    out[node].box = out[children].box; out[node].box.grow(out[children+1].box);
+  }
+
+  // morton codes, parallel radix sort, then clusters of codes sharing their leading bits are built in parallel.
+  // the levels above the clusters are either split on code bits as well, or built with binned SAH over the cluster boxes
+  void build_lbvh(const std::vector<aabb>& boxes, const bool sah_top, worker_pool* pool){
+    const uint32_t n = uint32_t(boxes.size());
+    const int workers = pool ? pool->size() : 1;
+    std::vector<aabb> partial(workers);
+    parallel_for(pool, n, [&](size_t b, size_t e, int id){ for(size_t i = b; i < e; i++) partial[id].grow(boxes[i].centroid()); }, 4096);
+    aabb centroid_bounds; for(const auto& p : partial) centroid_bounds.grow(p);
+
+    std::vector<uint32_t> codes(n);
+    index_storage.resize(n);
+    parallel_for(pool, n, [&](size_t b, size_t e, int){
+      for(size_t i = b; i < e; i++){
+        const vec3 c = boxes[i].centroid();
+        uint32_t q[3];
+        for(int a = 0; a < 3; a++){
+          const base_type extent = centroid_bounds.hi.values[a] - centroid_bounds.lo.values[a];
+          q[a] = extent > 0. ? uint32_t(std::clamp((c.values[a] - centroid_bounds.lo.values[a]) / extent * (1 << MORTON_BITS), 0., (1 << MORTON_BITS) - 1.)) : 0;
+        }
+        codes[i] = (expand_bits(q[0]) << 2) | (expand_bits(q[1]) << 1) | expand_bits(q[2]);
+        index_storage[i] = uint32_t(i);
+      }
+    }, 4096);
+    radix_sort(codes, index_storage, pool);
+
+    std::vector<uint32_t> starts; // cluster boundaries in the sorted order
+    for(uint32_t i = 0; i < n; i++)
+      if(i == 0 || (codes[i] >> (3*MORTON_BITS - LBVH_CLUSTER_BITS)) != (codes[i-1] >> (3*MORTON_BITS - LBVH_CLUSTER_BITS)))
+        starts.push_back(i);
+    const uint32_t clusters = uint32_t(starts.size());
+    starts.push_back(n);
+    std::vector<std::vector<bvh_node>> subtrees(clusters);
+    parallel_for(pool, clusters, [&](size_t b, size_t e, int){
+      for(size_t c = b; c < e; c++){
+        subtrees[c].assign(1, bvh_node{});
+        emit_morton(subtrees[c], 0, codes.data(), starts[c], starts[c+1], BVH_MAX_LEAF, [&](uint32_t i){ return boxes[index_storage[i]]; });
+      }
+    });
+
+    // top levels, with one cluster per leaf
+    std::vector<aabb> cluster_boxes(clusters); std::vector<uint32_t> order(clusters);
+    for(uint32_t c = 0; c < clusters; c++){ cluster_boxes[c] = subtrees[c][0].box; order[c] = c; }
+    if(sah_top)
+      build_sah(cluster_boxes, order, node_storage, 1);
+    else {
+      std::vector<uint32_t> cluster_codes(clusters);
+      for(uint32_t c = 0; c < clusters; c++) cluster_codes[c] = codes[starts[c]];
+      node_storage.assign(1, bvh_node{});
+      emit_morton(node_storage, 0, cluster_codes.data(), 0, clusters, 1, [&](uint32_t c){ return cluster_boxes[c]; });
+    }
+
+    // each top leaf takes its cluster's root, the rest of the cluster goes after the top levels, children still in pairs
+    std::vector<uint32_t> slot(clusters), base(clusters);
+    size_t total = node_storage.size();
+    for(uint32_t i = 0; i < node_storage.size(); i++)
+      if(node_storage[i].count) slot[order[node_storage[i].left_first]] = i;
+    for(uint32_t c = 0; c < clusters; c++){ base[c] = uint32_t(total); total += subtrees[c].size() - 1; }
+    node_storage.resize(total);
+    parallel_for(pool, clusters, [&](size_t b, size_t e, int){
+      for(size_t c = b; c < e; c++){
+        const std::vector<bvh_node>& sub = subtrees[c];
+        for(size_t k = 0; k < sub.size(); k++){
+          bvh_node nd = sub[k];
+          if(nd.count == 0) nd.left_first = base[c] + nd.left_first - 1; // sub index k > 0 lands at base + k - 1
+          node_storage[k ? base[c] + k - 1 : slot[c]] = nd;
+        }
+      }
+    });
+  }
+
+
+  // binned SAH with spatial splits (Stich et al. 2009). where the best object split leaves its children overlapping by
+  // more than split_alpha of the root area, planes through the node box are tried as well, with primitives that
+  // straddle the plane clipped to either side - triangles exactly, anything else by its box. a straddling reference
+  // goes to one side whole when that is cheaper (unsplitting), and once split_budget duplicates exist only object
+  // splits are made
+  void build_sbvh(const std::vector<aabb>& boxes, const std::vector<primitive_record>& records, const bvh_params& params){
+    struct reference{ aabb box; uint32_t prim; };
+    const size_t n = boxes.size(), max_references = n + size_t(params.split_budget * n);
+    size_t references = n;
+    std::vector<reference> all(n); aabb root_box;
+    for(uint32_t i = 0; i < n; i++){ all[i] = {boxes[i], i}; root_box.grow(boxes[i]); }
+    const base_type root_area = std::max(root_box.surface_area(), HIT_EPSILON);
+    auto clip = [&](const reference& r, const int axis, const base_type lo, const base_type hi){ // part of r inside the slab
+      const primitive_record& rec = records[r.prim];
+      aabb b = r.box;
+      if(rec.type == TRIANGLE){
+        const vec3 p[3] = {vec3(rec.data[0], rec.data[1], rec.data[2]), vec3(rec.data[3], rec.data[4], rec.data[5]), vec3(rec.data[6], rec.data[7], rec.data[8])};
+        b = clip_triangle(p, axis, lo, hi);
+      } else {
+        b.lo.values[axis] = std::max(b.lo.values[axis], lo); b.hi.values[axis] = std::min(b.hi.values[axis], hi);
+      }
+      return intersection(b, r.box);
+    };
+
+    node_storage.assign(1, bvh_node{}); index_storage.clear();
+    struct task{ uint32_t node; int depth; std::vector<reference> refs; };
+    std::vector<task> work; work.push_back({0, 0, std::move(all)});
+    while(!work.empty()){
+      task t = std::move(work.back()); work.pop_back();
+      std::vector<reference>& refs = t.refs;
+      const uint32_t count = uint32_t(refs.size());
+      aabb box, centroid_bounds;
+      for(const auto& r : refs){ box.grow(r.box); centroid_bounds.grow(r.box.centroid()); }
+      node_storage[t.node].box = box;
+      const base_type parent_area = std::max(box.surface_area(), HIT_EPSILON);
+
+      // object split, binned over reference centroids
+      int object_axis = -1, object_bin = 0; base_type object_cost = DMAX_TRAVEL; aabb object_left, object_right;
+      for(int a = 0; a < 3 && count > 1 && t.depth < BVH_MAX_DEPTH; a++){
+        const base_type lo = centroid_bounds.lo.values[a], extent = centroid_bounds.hi.values[a] - lo;
+        if(extent <= 0.) continue;
+        aabb bin_box[BVH_BINS]; uint32_t bin_count[BVH_BINS] = {};
+        for(const auto& r : refs){
+          const int b = std::min(BVH_BINS-1, int(BVH_BINS * (r.box.centroid().values[a] - lo) / extent));
+          bin_box[b].grow(r.box); bin_count[b]++;
+        }
+        aabb right_box[BVH_BINS]; uint32_t right_count[BVH_BINS];
+        aabb acc; uint32_t c = 0;
+        for(int b = BVH_BINS-1; b > 0; b--){ acc.grow(bin_box[b]); c += bin_count[b]; right_box[b] = acc; right_count[b] = c; }
+        acc = aabb(); c = 0;
+        for(int b = 1; b < BVH_BINS; b++){
+          acc.grow(bin_box[b-1]); c += bin_count[b-1];
+          if(c == 0 || right_count[b] == 0) continue;
+          const base_type cost = 1. + (acc.surface_area()*c + right_box[b].surface_area()*right_count[b]) / parent_area;
+          if(cost < object_cost){ object_cost = cost; object_axis = a; object_bin = b; object_left = acc; object_right = right_box[b]; }
+        }
+      }
+
+      // spatial split, binned over the node box - each reference is clipped into every bin it spans
+      int spatial_axis = -1; base_type spatial_plane = 0., spatial_cost = DMAX_TRAVEL;
+      aabb spatial_left, spatial_right; uint32_t spatial_left_count = 0, spatial_right_count = 0;
+      const bool overlapping = object_axis < 0 || intersection(object_left, object_right).surface_area() / root_area > params.split_alpha;
+      for(int a = 0; a < 3 && overlapping && count > 1 && t.depth < BVH_MAX_DEPTH && references < max_references; a++){
+        const base_type lo = box.lo.values[a], width = (box.hi.values[a] - lo) / BVH_BINS;
+        if(width <= 0.) continue;
+        auto bin_of = [&](base_type x){ return std::clamp(int((x - lo) / width), 0, BVH_BINS-1); };
+        aabb bin_box[BVH_BINS]; uint32_t entries[BVH_BINS] = {}, exits[BVH_BINS] = {};
+        for(const auto& r : refs){
+          const int b0 = bin_of(r.box.lo.values[a]), b1 = bin_of(r.box.hi.values[a]);
+          entries[b0]++; exits[b1]++;
+          if(b0 == b1) bin_box[b0].grow(r.box);
+          else for(int b = b0; b <= b1; b++) bin_box[b].grow(clip(r, a, lo + b*width, lo + (b+1)*width));
+        }
+        aabb right_box[BVH_BINS]; uint32_t right_count[BVH_BINS];
+        aabb acc; uint32_t c = 0;
+        for(int b = BVH_BINS-1; b > 0; b--){ acc.grow(bin_box[b]); c += exits[b]; right_box[b] = acc; right_count[b] = c; }
+        acc = aabb(); c = 0;
+        for(int b = 1; b < BVH_BINS; b++){ // plane between bin b-1 and b
+          acc.grow(bin_box[b-1]); c += entries[b-1];
+          if(c == 0 || right_count[b] == 0) continue;
+          const base_type cost = 1. + (acc.surface_area()*c + right_box[b].surface_area()*right_count[b]) / parent_area;
+          if(cost < spatial_cost){
+            spatial_cost = cost; spatial_axis = a; spatial_plane = lo + b*width;
+            spatial_left = acc; spatial_right = right_box[b]; spatial_left_count = c; spatial_right_count = right_count[b];
+          }
+        }
+      }
+
+      const base_type best_cost = std::min(object_cost, spatial_cost);
+      if(count <= 1 || (count <= BVH_MAX_LEAF && best_cost >= base_type(count))){ // leaf
+        node_storage[t.node].left_first = uint32_t(index_storage.size()); node_storage[t.node].count = count;
+        for(const auto& r : refs) index_storage.push_back(r.prim);
+        continue;
+      }
+      std::vector<reference> left, right;
+      if(spatial_cost < object_cost){
+        const int a = spatial_axis;
+        const base_type split_area = spatial_left.surface_area()*spatial_left_count + spatial_right.surface_area()*spatial_right_count;
+        for(const auto& r : refs){
+          if(r.box.hi.values[a] <= spatial_plane){ left.push_back(r); continue; }
+          if(r.box.lo.values[a] >= spatial_plane){ right.push_back(r); continue; }
+          aabb whole_left = spatial_left, whole_right = spatial_right;
+          whole_left.grow(r.box); whole_right.grow(r.box);
+          const base_type only_left = whole_left.surface_area()*spatial_left_count + spatial_right.surface_area()*(spatial_right_count-1);
+          const base_type only_right = spatial_left.surface_area()*(spatial_left_count-1) + whole_right.surface_area()*spatial_right_count;
+          if(only_left < split_area && only_left <= only_right) left.push_back(r);
+          else if(only_right < split_area) right.push_back(r);
+          else {
+            const aabb l = clip(r, a, -DMAX_TRAVEL, spatial_plane), h = clip(r, a, spatial_plane, DMAX_TRAVEL);
+            if(!l.empty()) left.push_back({l, r.prim});
+            if(!h.empty()) right.push_back({h, r.prim});
+          }
+        }
+      }
+      if(left.empty() || right.empty()){ // object split - or the spatial one came out one sided
+        left.clear(); right.clear();
+        if(object_axis >= 0){
+          const base_type lo = centroid_bounds.lo.values[object_axis], extent = centroid_bounds.hi.values[object_axis] - lo;
+          for(const auto& r : refs)
+            (std::min(BVH_BINS-1, int(BVH_BINS * (r.box.centroid().values[object_axis] - lo) / extent)) < object_bin ? left : right).push_back(r);
+        } else { // deep, or every centroid in one place - median of the widest axis
+          const vec3 d = centroid_bounds.hi - centroid_bounds.lo;
+          const int a = (d.values[0] > d.values[1] && d.values[0] > d.values[2]) ? 0 : (d.values[1] > d.values[2]) ? 1 : 2;
+          std::nth_element(refs.begin(), refs.begin() + count/2, refs.end(),
+            [a](const reference& x, const reference& y){ return x.box.centroid().values[a] < y.box.centroid().values[a]; });
+          left.assign(refs.begin(), refs.begin() + count/2); right.assign(refs.begin() + count/2, refs.end());
+        }
+      }
+      references += left.size() + right.size() - count;
+      const uint32_t children = uint32_t(node_storage.size());
+      node_storage[t.node].left_first = children; node_storage[t.node].count = 0;
+      node_storage.emplace_back(); node_storage.emplace_back();
+      refs.clear(); refs.shrink_to_fit();
+      work.push_back({children, t.depth+1, std::move(left)});
+      work.push_back({children+1, t.depth+1, std::move(right)});
+    }
+  }
+
+  // packs the triangles of every leaf holding at least two, each in its leaf position - redone on every build,
+  // map and refit rather than cached, it is quick to make
+  void build_packets(const primitive_list& prims, worker_pool* pool){
+    const bvh_node* nodes = node_data(); const uint32_t* indices = index_data();
+    std::vector<unsigned char> is_triangle(prims.size()); // in list order first - the leaves visit primitives all over memory
+    parallel_for(pool, prims.size(), [&](size_t b, size_t e, int){
+      for(size_t i = b; i < e; i++) is_triangle[i] = dynamic_cast<const triangle*>(prims[i].get()) != nullptr;
+    }, 1024);
+    node_packet.assign(node_total, -1);
+    parallel_for(pool, node_total, [&](size_t b, size_t e, int){ // which leaves get a packet, then their numbers in node order
+      for(size_t i = b; i < e; i++){
+        if(nodes[i].count == 0 || nodes[i].count > uint32_t(TRIANGLE_LANES)) continue;
+        int triangles = 0;
+        for(uint32_t k = nodes[i].left_first; k < nodes[i].left_first + nodes[i].count; k++)
+          triangles += is_triangle[indices[k]];
+        if(triangles >= 2) node_packet[i] = 0;
+      }
+    }, 1024);
+    uint32_t total = 0;
+    for(size_t i = 0; i < node_total; i++)
+      if(node_packet[i] == 0) node_packet[i] = int32_t(total++);
+    packets.assign(total, triangle4());
+    parallel_for(pool, node_total, [&](size_t b, size_t e, int){
+      for(size_t i = b; i < e; i++){
+        if(node_packet[i] < 0) continue;
+        for(uint32_t k = 0; k < nodes[i].count; k++){
+          const uint32_t index = indices[nodes[i].left_first + k];
+          if(is_triangle[index]) packets[node_packet[i]].set(k, static_cast<const triangle&>(*prims[index]));
+        }
+      }
+    }, 1024);
+  }
+
+  // checks run on the pool: the records against the scene's, and every node and index against the array bounds
+  bool map_cache(const std::string& path, const uint64_t hash, const std::vector<primitive_record>& records, worker_pool* pool){
+    auto f = std::make_shared<mapped_file>(path);
+    if(!f->valid() || f->size() < sizeof(bvh_cache_header)) return false;
+    const bvh_cache_header* h = reinterpret_cast<const bvh_cache_header*>(f->data());
+    const size_t n = records.size();
+    if(std::memcmp(h->magic, BVH_CACHE_MAGIC, 8) != 0 || h->scene_hash != hash || h->primitive_count != n || h->node_count == 0) return false;
+    const size_t record_bytes = n * sizeof(primitive_record), node_bytes = h->node_count * sizeof(bvh_node), refs = h->index_count;
+    if(f->size() != sizeof(bvh_cache_header) + record_bytes + node_bytes + refs * sizeof(uint32_t)) return false;
+    const char* p = f->data() + sizeof(bvh_cache_header);
+    const primitive_record* file_records = reinterpret_cast<const primitive_record*>(p);
+    const bvh_node* file_nodes = reinterpret_cast<const bvh_node*>(p + record_bytes);
+    const uint32_t* file_indices = reinterpret_cast<const uint32_t*>(p + record_bytes + node_bytes);
+    const size_t nodes = h->node_count;
+    std::atomic<bool> ok{true};
+    parallel_for(pool, n, [&](size_t b, size_t e, int){ // a hash collision, or a stale file
+      if(std::memcmp(file_records + b, records.data() + b, (e - b) * sizeof(primitive_record)) != 0) ok = false;
+    }, HASH_BLOCK);
+    parallel_for(pool, nodes, [&](size_t b, size_t e, int){ // a damaged file must not send traversal out of bounds
+      for(size_t i = b; i < e; i++){
+        const bvh_node& nd = file_nodes[i];
+        if(nd.count ? uint64_t(nd.left_first) + nd.count > refs : uint64_t(nd.left_first) + 1 >= nodes){ ok = false; return; }
+      }
+    }, HASH_BLOCK);
+    parallel_for(pool, refs, [&](size_t b, size_t e, int){
+      for(size_t i = b; i < e; i++) if(file_indices[i] >= n){ ok = false; return; }
+    }, HASH_BLOCK);
+    if(!ok) return false;
+    map = f; mapped_nodes = file_nodes; mapped_indices = file_indices;
+    node_total = nodes; primitive_total = n; index_total = refs; built_cost = h->build_cost;
+    return true;
+  }
+
+  bool save_cache(const std::string& dir, const std::string& path, const uint64_t hash, const std::vector<primitive_record>& records) const {
+    if(mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) return false;
+    const std::string temp = path + ".tmp" + std::to_string(getpid()); // renamed into place, readers never see a partial file
+    {
+      std::ofstream f(temp, std::ios::binary);
+      bvh_cache_header h{};
+      std::memcpy(h.magic, BVH_CACHE_MAGIC, 8);
+      h.scene_hash = hash; h.primitive_count = records.size(); h.node_count = node_total; h.index_count = index_total; h.build_cost = built_cost;
+      f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+      f.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(primitive_record));
+      f.write(reinterpret_cast<const char*>(node_data()), node_total * sizeof(bvh_node));
+      f.write(reinterpret_cast<const char*>(index_data()), index_total * sizeof(uint32_t));
+      if(!f){ std::remove(temp.c_str()); return false; }
+    }
+    return std::rename(temp.c_str(), path.c_str()) == 0;
+  }
+};
+
+#endif
@@ -0,0 +1,257 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <fstream>
+#include <functional>
+#include <charconv> // to_chars
+
+#include "core.h"
+#include "termination.h" // RR_MIN_SURVIVAL
+
+// runtime configuration - every key can be given as '--key value' on the command line, or as a
+// 'key = value' line in a file passed with '--config file'. later settings override earlier ones.
+
+struct render_settings{ // per-renderer parameters, defaults from the constants in core.h
+  int xdim = X_IMAGE_DIM, ydim = Y_IMAGE_DIM; // output resolution
+  int nsamples = NUM_SAMPLES;                // samples per pixel
+  int bounces = MAX_BOUNCES;                // path length limit
+  std::string rr = "max";                  // russian roulette policy - max, luminance or efficiency, see termination.h
+  int rr_min_depth = 0;                    // bounces before roulette starts
+  base_type rr_max_survival = 0.95;       // cap on the luminance and efficiency survival probability
+  int threads = NUM_THREADS;               // worker threads, plus one for the reporter
+  int tile = TILESIZE_XY;                 // tile edge length, in pixels
+  base_type fov = FIELD_OF_VIEW;         // camera field of view
+  base_type gamma = IMAGE_GAMMA;        // output gamma
+  long long primitives = NUM_PRIMITIVES; // triangle+sphere pairs in the generated scene
+  unsigned long long seed = 0;          // 0 seeds from std::random_device, anything else is fully deterministic
+  bool random_camera = true;           // false uses camera_position instead of a seeded random one
+  vec3 camera_position = vec3(0., 0., 2.5);
+  bool quiet = false;                 // no progress bar or console report
+  std::string report_path;           // if set, a json report is appended here per frame ("-" for a line on stderr)
+  bool heatmap = false;             // write tile time and per pixel ray/bounce heatmaps next to the render
+  int denoise = 0;                 // edge-avoiding à-trous passes over the finished image, 0 for none
+  base_type denoise_color = 0.6, denoise_normal = 0.3, denoise_depth = 0.05; // its edge-stopping widths
+  int guide = 0;                  // path guiding training passes before the render, 0 for none - see guiding.h
+  base_type guide_fraction = 0.5; // share of guided bounces that sample the learned distribution instead of the bsdf
+  int primary_cache = 0;          // MB kept for first hits, replayed while camera and geometry stay the same - see primary.h
+  bool incremental = false;       // renders after the first redo only the tiles edits have touched - see incremental.h
+  int preview = 0;                // localhost port serving the image so far and the render's status, 0 for none - see preview.h
+  int preview_interval = 1000;    // ms between preview encodings
+  std::string preview_format = "jpg"; // preview encoding, jpg or png
+  std::string lights = "none";    // emitters sampled directly at every diffuse bounce - none, uniform or bvh, see lights.h
+  std::string aov;                // first hit outputs written next to the render, comma separated - see aov.h
+  std::string mesh;                // .obj or .amesh file added to the scene
+  int mesh_material = 3;          // material index for the mesh triangles
+  bool mesh_fit = true;          // scale and center the mesh into the [-1,1] cube
+  bool mesh_cache = false;      // write <mesh>.obj.amesh after parsing, and map it on later runs
+  bool woop = false;           // triangles in the Baldwin-Weber transformed form, instead of Möller–Trumbore on stored edges
+  long long instances = 0;     // place the mesh (or a small generated object) this many times as instances instead
+  std::string bvh_cache;       // directory of built hierarchies keyed by scene hash, empty to always build
+  std::string accel = "bvh";       // acceleration structure over the scene - linear, bvh or grid
+  bool validate_accel = false;     // cross-check every query against the linear scan
+  std::string bvh_build = "hlbvh"; // bvh builder - sah, lbvh, hlbvh or sbvh
+  base_type split_alpha = 1e-5;    // sbvh: child overlap, relative to the root area, above which spatial splits are tried
+  base_type split_budget = 1.;    // sbvh: duplicated references allowed, as a fraction of the primitive count
+  base_type refit_threshold = 0.25; // animation: rebuild instead of refitting once the bvh's SAH cost has grown by this fraction
+};
+
+struct job_config{ // a render job - the renderer settings plus which frames to write where
+  render_settings render;
+  std::string output = "outputs/out%d.png"; // %d is replaced by the frame number
+  int first_frame = 72, last_frame = 100;
+  bool animate = false; // one scene for all frames, moved between them, instead of a new one per frame
+  int coordinator = 0;      // port to hand tiles out on to worker processes, 0 to render here - see distributed.h
+  std::string worker;       // host:port of a coordinator to render tiles for, instead of a job of its own
+  int worker_timeout = 120; // seconds a worker may take over a batch of tiles before its tiles go to another
+  std::string frame_filename(int frame) const { // without a %d, multiple frames get the number before the extension
+    std::string name = output;
+    const size_t marker = name.find("%d");
+    if(marker != std::string::npos)
+      return name.replace(marker, 2, std::to_string(frame));
+    if(first_frame == last_frame)
+      return name;
+    const size_t dot = name.rfind('.');
+    return name.insert(dot == std::string::npos ? name.size() : dot, std::to_string(frame));
+  }
+};
+
+struct config_option{ // one key, with its parser and printer
+  std::string key, help;
+  bool flag; // boolean - on the command line it can be given without a value
+  std::function<void(job_config&, const std::string&)> set;
+  std::function<std::string(const job_config&)> get;
+};
+
+inline std::string real_string(const double v){ // the shortest text that reads back as exactly v
+  char text[32]; const auto end = std::to_chars(text, text + sizeof(text), v).ptr;
+  return std::string(text, end);
+}
+inline std::string vec3_string(const vec3& v){
+  return real_string(v.values[0]) + "," + real_string(v.values[1]) + "," + real_string(v.values[2]);
+}
+inline vec3 parse_vec3(const std::string& value){ // "x,y,z"
+  vec3 v; char comma; std::stringstream s(value);
+  if(!(s >> v.values[0] >> comma >> v.values[1] >> comma >> v.values[2]))
+    throw std::invalid_argument("expected x,y,z");
+  return v;
+}
+inline bool is_bool(const std::string& value){
+  for(const char* b : { "1", "0", "true", "false", "on", "off", "yes", "no" })
+    if(value == b) return true;
+  return false;
+}
+inline bool parse_bool(const std::string& value){
+  if(!is_bool(value)) throw std::invalid_argument("expected a boolean");
+  return value == "1" || value == "true" || value == "on" || value == "yes";
+}
+
+inline const std::vector<config_option>& config_options(){
+  #define OPTION_INT(key, field, help) { key, help, false, [](job_config& c, const std::string& v){ c.field = std::stoll(v); }, [](const job_config& c){ return std::to_string(c.field); } }
+  #define OPTION_REAL(key, field, help) { key, help, false, [](job_config& c, const std::string& v){ c.field = std::stod(v); }, [](const job_config& c){ return real_string(c.field); } }
+  #define OPTION_STRING(key, field, help) { key, help, false, [](job_config& c, const std::string& v){ c.field = v; }, [](const job_config& c){ return c.field; } }
+  #define OPTION_FLAG(key, field, help) { key, help, true, [](job_config& c, const std::string& v){ c.field = parse_bool(v); }, [](const job_config& c){ return std::string(c.field ? "1" : "0"); } }
+  static const std::vector<config_option> options = {
+    OPTION_INT("width", render.xdim, "image width in pixels"),
+    OPTION_INT("height", render.ydim, "image height in pixels"),
+    OPTION_INT("spp", render.nsamples, "samples per pixel"),
+    OPTION_INT("bounces", render.bounces, "maximum path length"),
+    OPTION_STRING("rr", render.rr, "russian roulette: max (throughput channel), luminance (of the weighted throughput) or efficiency (variance vs cost)"),
+    OPTION_INT("rr_min_depth", render.rr_min_depth, "bounces before russian roulette starts"),
+    OPTION_REAL("rr_max_survival", render.rr_max_survival, "luminance and efficiency roulette: highest survival probability"),
+    OPTION_INT("threads", render.threads, "worker thread count"),
+    OPTION_INT("tile", render.tile, "tile size in pixels (8, 16 and 32 have specialized loops)"),
+    OPTION_REAL("fov", render.fov, "camera field of view"),
+    OPTION_REAL("gamma", render.gamma, "output gamma"),
+    OPTION_INT("primitives", render.primitives, "triangle+sphere pairs in the generated scene"),
+    OPTION_INT("seed", render.seed, "scene and sampling seed, 0 for random"),
+    { "camera", "'random', or a position x,y,z looking at the origin", false,
+      [](job_config& c, const std::string& v){ c.render.random_camera = (v == "random"); if(v != "random") c.render.camera_position = parse_vec3(v); },
+      [](const job_config& c){ return c.render.random_camera ? std::string("random") : vec3_string(c.render.camera_position); } },
+    OPTION_FLAG("quiet", render.quiet, "no progress bar or console report"),
+    OPTION_STRING("report", render.report_path, "append a json report per frame to this file, '-' for stderr"),
+    OPTION_FLAG("heatmap", render.heatmap, "write tile time and ray count heatmaps"),
+    OPTION_INT("denoise", render.denoise, "edge-avoiding a-trous filter passes, guided by first hit normal, albedo and depth (0 for off)"),
+    OPTION_REAL("denoise_color", render.denoise_color, "denoiser: luminance difference, compressed to [0,1), that stops the filter"),
+    OPTION_REAL("denoise_normal", render.denoise_normal, "denoiser: normal difference that stops the filter"),
+    OPTION_REAL("denoise_depth", render.denoise_depth, "denoiser: relative depth difference that stops the filter"),
+    OPTION_INT("guide", render.guide, "path guiding: training passes (1, 2, 4, ... spp) that learn incident light before the render (0 for off)"),
+    OPTION_REAL("guide_fraction", render.guide_fraction, "path guiding: probability of sampling a bounce from the learned distribution"),
+    OPTION_INT("preview", render.preview, "serve the image in progress and a json status on this localhost port, instead of the progress bar (0 for off)"),
+    OPTION_INT("preview_interval", render.preview_interval, "ms between preview encodings"),
+    OPTION_STRING("preview_format", render.preview_format, "preview encoding: jpg or png"),
+    OPTION_STRING("lights", render.lights, "direct light sampling: none, uniform (any emitter equally) or bvh (by estimated contribution)"),
+    OPTION_STRING("aov", render.aov, "first hit outputs written as <name>_<aov>.pfm: depth,normal,albedo,material,primitive,throughput"),
+    OPTION_STRING("mesh", render.mesh, "add a mesh from an .obj or .amesh file"),
+    OPTION_INT("mesh_material", render.mesh_material, "material index for the mesh"),
+    OPTION_FLAG("mesh_fit", render.mesh_fit, "fit the mesh into the [-1,1] cube"),
+    OPTION_FLAG("mesh_cache", render.mesh_cache, "cache parsed .obj files as .amesh next to them"),
+    OPTION_FLAG("woop", render.woop, "test triangles by transforming the ray to unit triangle space (bvh leaves then skip the SoA packets)"),
+    OPTION_INT("instances", render.instances, "copies of the mesh, or of a generated object, added as instances"),
+    OPTION_STRING("accel", render.accel, "acceleration structure: linear, bvh or grid (two level, 3D-DDA)"),
+    OPTION_FLAG("validate_accel", render.validate_accel, "check every ray query against the linear scan, and report mismatches"),
+    OPTION_STRING("bvh_build", render.bvh_build, "bvh builder: sah, sbvh (single threaded), lbvh or hlbvh (parallel)"),
+    OPTION_REAL("split_alpha", render.split_alpha, "sbvh: overlap above which spatial splits are tried, relative to the root area"),
+    OPTION_REAL("split_budget", render.split_budget, "sbvh: duplicate references allowed, as a fraction of the primitive count"),
+    OPTION_REAL("refit_threshold", render.refit_threshold, "with --animate, SAH cost growth that triggers a bvh rebuild"),
+    OPTION_STRING("bvh_cache", render.bvh_cache, "directory to cache built bvhs in, keyed by scene contents"),
+    OPTION_FLAG("animate", animate, "keep one scene across frames and move it, refitting the bvh"),
+    OPTION_STRING("output", output, "output filename, %d is replaced by the frame number"),
+    OPTION_INT("coordinator", coordinator, "hand the frames' tiles out over tcp on this port to --worker processes, which render them (0 for off)"),
+    OPTION_STRING("worker", worker, "render tiles for the coordinator at host:port, with its configuration and this process's --threads"),
+    OPTION_INT("worker_timeout", worker_timeout, "seconds a batch of tiles may take before the coordinator gives it to another worker, and a worker tries to connect"),
+    { "frames", "frame range first:last, or a single frame", false,
+      [](job_config& c, const std::string& v){
+        const size_t colon = v.find(':');
+        c.first_frame = std::stoi(v.substr(0, colon));
+        c.last_frame = (colon == std::string::npos) ? c.first_frame : std::stoi(v.substr(colon+1)); },
+      [](const job_config& c){ return std::to_string(c.first_frame) + ":" + std::to_string(c.last_frame); } },
+  };
+  #undef OPTION_INT
+  #undef OPTION_REAL
+  #undef OPTION_STRING
+  #undef OPTION_FLAG
+  return options;
+}
+
+inline const config_option* find_option(const std::string& key){
+  for(const auto& o : config_options())
+    if(o.key == key) return &o;
+  return nullptr;
+}
+
+inline bool apply_option(job_config& c, const std::string& key, const std::string& value){ // false on an unknown key or bad value
+  const config_option* o = find_option(key);
+  if(!o){ cerr << "unknown option \'" << key << "\'" << endl; return false; }
+  try { o->set(c, value); } catch(const std::exception& e) {
+    cerr << "bad value \'" << value << "\' for \'" << key << "\'" << endl; return false;
+  }
+  return true;
+}
+
+inline std::string trim(const std::string& s){
+  const size_t first = s.find_first_not_of(" \t\r"), last = s.find_last_not_of(" \t\r");
+  return (first == std::string::npos) ? "" : s.substr(first, last-first+1);
+}
+
+inline bool load_config(job_config& c, std::istream& f, const std::string& path){ // 'key = value' lines, '#' starts a comment
+  std::string line; int number = 0;
+  while(std::getline(f, line)){
+    number++;
+    line = trim(line.substr(0, line.find('#')));
+    if(line.empty()) continue;
+    const size_t equals = line.find('=');
+    if(equals == std::string::npos){ cerr << path << ":" << number << ": expected key = value" << endl; return false; }
+    if(!apply_option(c, trim(line.substr(0, equals)), trim(line.substr(equals+1)))) return false;
+  }
+  return true;
+}
+inline bool load_config_file(job_config& c, const std::string& path){
+  std::ifstream f(path);
+  if(!f){ cerr << "can't open config file \'" << path << "\'" << endl; return false; }
+  return load_config(c, f, path);
+}
+
+inline bool parse_command_line(job_config& c, int argc, char const *argv[]){ // a bare argument is the output filename
+  for (int i = 1; i < argc; i++){
+    const std::string arg = argv[i];
+    if(arg.rfind("--", 0) != 0){ c.output = arg; continue; }
+    const std::string key = arg.substr(2);
+    if(key == "config"){
+      if(i+1 >= argc || !load_config_file(c, argv[++i])) return false;
+      continue;
+    }
+    const config_option* o = find_option(key);
+    const bool has_value = i+1 < argc && std::string(argv[i+1]).rfind("--", 0) != 0;
+    if(o && o->flag && !(has_value && is_bool(argv[i+1]))){ o->set(c, "1"); continue; } // anything else is the next argument
+    if(!has_value){ cerr << "missing value for \'" << arg << "\'" << endl; return false; }
+    if(!apply_option(c, key, argv[++i])) return false;
+  }
+  if(c.render.xdim < 1 || c.render.ydim < 1 || c.render.nsamples < 1 || c.render.threads < 1 || c.render.tile < 1 || c.render.bounces < 1){
+    cerr << "width, height, spp, bounces, threads and tile must all be positive" << endl; return false;
+  }
+  if(!(c.render.denoise_color > 0.) || !(c.render.denoise_normal > 0.) || !(c.render.denoise_depth > 0.)){ // they divide the differences
+    cerr << "denoise_color, denoise_normal and denoise_depth must be positive" << endl; return false;
+  }
+  if(c.render.rr_min_depth < 0 || !(c.render.rr_max_survival >= RR_MIN_SURVIVAL && c.render.rr_max_survival <= 1.)){ // clamp needs lo <= hi
+    cerr << "rr_min_depth can't be negative, and rr_max_survival must be in [" << RR_MIN_SURVIVAL << ", 1]" << endl; return false;
+  }
+  return true;
+}
+
+inline std::string config_string(const job_config& c){ // the full configuration, in config file format
+  std::stringstream s;
+  for(const auto& o : config_options())
+    s << o.key << " = " << o.get(c) << endl;
+  return s.str();
+}
+
+inline void print_usage(const char* program){
+  cout << "usage: " << program << " [output] [--config file] [--key value ...]" << endl;
+  size_t width = 0;
+  for(const auto& o : config_options()) width = std::max(width, o.key.size());
+  for(const auto& o : config_options())
+    cout << "  --" << std::left << std::setw(int(width) + 2) << o.key << o.help << " (" << o.get(job_config()) << ")" << endl;
+  cout << std::right;
+}
+
+#endif
@@ -0,0 +1,177 @@
+#ifndef CORE_H
+#define CORE_H
+
+#include <chrono>          // timing utilities
+#include <ctime>          // cpu time
+#include <iostream>       // text i/o
+#include <iomanip>
+using std::cerr, std::cin, std::cout, std::endl, std::flush;
+#include <stdio.h>      // printf if needed
+#include <vector>      // std::vector
+#include <random>     // prng
+#include <string>    // std::string
+#include <sstream>    // std::stringstream
+#include <algorithm> // clamp
+#include <memory> // shared_ptr
+
+// my vector library
+#include "AMvector.h"
+
+// default types
+#define base_type double
+using vec2 = vector2<base_type>;
+using vec3 = vector3<base_type>;
+
+// render parameters
+constexpr long long X_IMAGE_DIM = 1920/2;
+constexpr long long Y_IMAGE_DIM = 1080/2;
+constexpr long long TILESIZE_XY = 8;
+constexpr long long MAX_BOUNCES = 69;
+constexpr long long NUM_SAMPLES = 420;
+constexpr long long NUM_THREADS = 4;
+constexpr base_type IMAGE_GAMMA = 2.2;
+constexpr base_type HIT_EPSILON = base_type(std::numeric_limits<base_type>::epsilon());
+constexpr base_type DMAX_TRAVEL = base_type(std::numeric_limits<base_type>::max())/10.;
+constexpr base_type FIELD_OF_VIEW = 0.69420;
+constexpr base_type PALETTE_SCALAR = 16.18;
+constexpr base_type BRIGHTNESS_SCALAR = 16.18;
+constexpr long long REPORT_DELAY = 618; // reporter thread sleep duration, in ms
+constexpr long long NUM_PRIMITIVES = 69;
+constexpr long long PROGRESS_INDICATOR_STOPS = 69; // cli spaces to take up
+constexpr base_type ANIMATION_AMPLITUDE = 0.04; // how far scene::animate moves things
+constexpr base_type ANIMATION_STEP = 0.25;      // animation time per frame
+
+
+
+
+// ray representation (origin+direction)
+struct ray{
+  vec3 origin;
+  vec3 direction;
+};
+
+// represents a ray hit and the associated information
+struct hitrecord {                // hit record
+    vec3 position;               // position
+    vec3 normal;                // normal
+    base_type dtransit = DMAX_TRAVEL; // how far the ray traveled, initially very large
+    int material_index = -1;         // material (indexed into scene list)
+    int primitive_index = 0;        // so you can refer to the values for this primitive later
+    int instance_index = -1;       // contents index of the instance hit, primitive_index is then within its object
+    vec2 uv;                       // used for triangles, barycentric coords
+    bool front;                   // hit on frontfacing side
+};
+
+// per-thread render counters - aligned to a cache line so that workers never share one
+struct alignas(64) render_stats {
+  unsigned long long samples = 0;            // pixel samples taken
+  unsigned long long camera_rays = 0;       // primary rays from camera::sample
+  unsigned long long camera_replays = 0;   // primary hits taken from the primary cache instead of traced
+  unsigned long long bounce_rays = 0;      // secondary rays, after the first hit
+  unsigned long long shadow_rays = 0;     // visibility rays toward lights
+  unsigned long long intersection_tests = 0; // primitive intersection tests
+  unsigned long long terminated_escape = 0;     // path left the scene
+  unsigned long long terminated_roulette = 0;  // killed by russian roulette
+  unsigned long long terminated_max_bounces = 0; // hit the MAX_BOUNCES limit
+  unsigned long long tiles = 0;   // tiles completed by this thread
+  double busy_seconds = 0.;      // wall time spent inside tiles
+  double cpu_seconds = 0.;      // thread cpu time for the whole render
+
+  unsigned long long total_rays() const { return camera_rays + bounce_rays + shadow_rays; }
+  render_stats& operator+=(const render_stats& other){
+    samples += other.samples;
+    camera_rays += other.camera_rays;
+    camera_replays += other.camera_replays;
+    bounce_rays += other.bounce_rays;
+    shadow_rays += other.shadow_rays;
+    intersection_tests += other.intersection_tests;
+    terminated_escape += other.terminated_escape;
+    terminated_roulette += other.terminated_roulette;
+    terminated_max_bounces += other.terminated_max_bounces;
+    tiles += other.tiles;
+    busy_seconds += other.busy_seconds;
+    cpu_seconds += other.cpu_seconds;
+    return *this;
+  }
+};
+
+// wall + cpu time of one phase of a frame (scene build, render, encode)
+struct phase_time { double wall = 0., cpu = 0.; };
+class phase_timer{ // starts timing on construction
+public:
+  phase_timer() : wall_start(std::chrono::steady_clock::now()), cpu_start(std::clock()) {}
+  phase_time elapsed() const {
+    return { std::chrono::duration<double>(std::chrono::steady_clock::now()-wall_start).count(),
+             double(std::clock()-cpu_start)/CLOCKS_PER_SEC }; // std::clock is process cpu time, all threads
+  }
+private:
+  std::chrono::steady_clock::time_point wall_start;
+  std::clock_t cpu_start;
+};
+inline double thread_cpu_seconds(){ // cpu time consumed by the calling thread
+  timespec t; clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+  return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+inline uint32_t wang_hash(uint32_t x){
+    x = (x ^ 12345391) * 2654435769;
+    x ^= (x << 6) ^ (x >> 26); x *= 2654435769;
+    x += (x << 5) ^ (x >> 12);
+    return x;
+}
+inline uint64_t fnv1a(const void* data, size_t size, uint64_t h = 14695981039346656037ull){ // 64 bit fnv-1a, chain calls through h
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  for(size_t i = 0; i < size; i++){ h ^= p[i]; h *= 1099511628211ull; }
+  return h;
+}
+
+// Random Utilities
+inline base_type rng(std::shared_ptr<std::mt19937_64> gen){ // gives a value in the range 0.-1.
+  std::uniform_real_distribution<base_type> distribution(0., 1.);
+  return distribution(*gen);
+}
+inline vec3 random_vector(std::shared_ptr<std::mt19937_64> gen){ // random vector centered around 0.
+  return vec3(rng(gen), rng(gen), rng(gen)) - vec3(0.5);
+}
+inline vec3 random_unit_vector(std::shared_ptr<std::mt19937_64> gen){ // random direction vector (unit length)
+  base_type z = rng(gen) * 2.0f - 1.0f;
+  base_type a = rng(gen) * 2. * pi;
+  base_type r = sqrt(1.0f - z * z);
+  base_type x = r * cos(a);
+  base_type y = r * sin(a);
+  return vec3(x, y, z);
+}
+inline vec3 random_in_unit_disk(std::shared_ptr<std::mt19937_64> gen){ // random in unit disk (xy plane)
+  vec3 val = random_unit_vector(gen);
+  return vec3(val.values[0], val.values[1], 0.);
+}
+
+// black -> red -> yellow -> white ramp for heatmaps, t in [0,1]
+inline vec3 heat_color( base_type t ){
+  t = std::clamp(t, 0., 1.) * 3.;
+  return vec3(std::clamp(t, 0., 1.), std::clamp(t-1., 0., 1.), std::clamp(t-2., 0., 1.));
+}
+
+// iq style palette
+inline vec3 palette( base_type t, vec3 a=vec3(0.5,0.5,0.5), vec3 b=vec3(0.5,0.5,0.5), vec3 c=vec3(1.0,1.0,1.0), vec3 d=vec3(0.00, 0.33, 0.67) ){
+  vec3 temp = (c * t + d) * 2. * pi;
+  return a + b * vec3(cos(temp.values[0]), cos(temp.values[1]), cos(temp.values[2]));
+}
+
+inline base_type luminance(const vec3& c){ return 0.2126*c.values[0] + 0.7152*c.values[1] + 0.0722*c.values[2]; }
+
+// filmic tonemap curve + gamma correction, in place
+inline void tonemap_and_gamma(vec3& in, const base_type gamma=IMAGE_GAMMA){
+  in *= 0.6f; // function to tonemap color value in place
+  base_type a = 2.51f;
+  base_type b = 0.03f;
+  base_type c = 2.43f;
+  base_type d = 0.59f;
+  base_type e = 0.14f;
+  in = (in*(a*in+vec3(b)))/(in*(c*in+vec3(d))+e); // tonemap
+  in.values[0] = std::pow(std::clamp(in.values[0], 0., 1.), 1./gamma); // gamma correct
+  in.values[1] = std::pow(std::clamp(in.values[1], 0., 1.), 1./gamma);
+  in.values[2] = std::pow(std::clamp(in.values[2], 0., 1.), 1./gamma);
+}
+
+#endif
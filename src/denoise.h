@@ -0,0 +1,105 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include <cstring> // memcpy
+
+#include "aov.h"
+#include "pool.h"
+
+// edge-avoiding à-trous wavelet filter (Dammertz et al. 2010) - a 5x5 B3-spline kernel run several times, its taps
+// spread 2^pass pixels apart, each tap weighted down where luminance, normal or depth differ from the center pixel's.
+// the lighting is filtered with the first hit's albedo divided out, so palette and emitter colors stay sharp
+
+struct denoise_settings{
+  int passes = 5;           // kernel footprint doubles every pass - 5 passes reach 2*(1+2+4+8+16) = 62 pixels out
+  float sigma_color = 0.6f;  // compressed luminance difference that drops a tap to 1/e, halved every pass
+  float sigma_normal = 0.3f; // distance between unit normals that does the same
+  float sigma_depth = 0.05f; // depth difference, relative to the nearer pixel and per pixel of tap distance
+};
+
+// exp(-e) for 0 <= e < 1e9, to ~1e-3 - plain arithmetic, so the tap loops vectorize. anything below 2^-125 is 0, as
+// denormal weights are very slow to sum. the cutoff is on the integer exponent, a float clamp keeps gcc from vectorizing
+inline float fast_exp_negative(float e){
+  const float x = -e * 1.44269504f; // as a power of two
+  const int i = int(x);            // truncates toward zero, leaving f in (-1, 0]
+  const float f = x - float(i);
+  const float p = 1.f + f*(0.69314718f + f*(0.24022651f + f*(0.05550411f + f*0.00961813f)));
+  const int bits = i < -125 ? 0 : (i + 127) << 23; float scale; std::memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+
+// filters color (linear, w*h, row major) in place, guided by the depth, normal and albedo aovs. rows are split over
+// the pool, and each row is one contiguous loop per tap
+inline void denoise(std::vector<vec3>& color, const aov_buffers& g, const int w, const int h, const denoise_settings& ds, worker_pool& pool){
+  constexpr float ALBEDO_EPSILON = 1e-3f; // darker channels are filtered as they are
+  constexpr float kernel[5] = { 1.f/16, 1.f/4, 3.f/8, 1.f/4, 1.f/16 };
+  const size_t n = size_t(w) * h;
+  std::vector<float> c[3], next[3], nrm[3], depth(n), luma(n); // planar, so a tap reads each channel contiguously
+  for(int ch = 0; ch < 3; ch++){ c[ch].resize(n); next[ch].resize(n); nrm[ch].resize(n); }
+  auto rows = [&](auto f){ pool.parallel_for(h, [&](size_t y0, size_t y1, int){ for(size_t y = y0; y < y1; y++) f(int(y)); }, 4); };
+
+  rows([&](int y){ // demodulate, and split into planes
+    for(size_t i = size_t(y)*w; i < size_t(y+1)*w; i++){
+      for(int ch = 0; ch < 3; ch++){
+        const float a = g.albedo[i].values[ch];
+        c[ch][i] = a > ALBEDO_EPSILON ? color[i].values[ch] / a : color[i].values[ch];
+        nrm[ch][i] = g.normal[i].values[ch];
+      }
+      depth[i] = g.depth[i];
+    }
+  });
+
+  for(int pass = 0; pass < ds.passes; pass++){
+    const int step = 1 << pass;
+    const float sigma_c = ds.sigma_color / step;
+    const float inv_color = 1.f / (sigma_c*sigma_c), inv_normal = 1.f / (ds.sigma_normal*ds.sigma_normal), inv_depth = 1.f / (ds.sigma_depth*step);
+    rows([&](int y){ // luminance, compressed to [0,1) so the color weight means the same in dark and bright regions
+      for(size_t i = size_t(y)*w; i < size_t(y+1)*w; i++){
+        const float l = 0.2126f*c[0][i] + 0.7152f*c[1][i] + 0.0722f*c[2][i];
+        luma[i] = l / (1.f + l);
+      }
+    });
+    rows([&, step, inv_color, inv_normal, inv_depth](int y){ // copies, or the stores below might alias them
+      std::vector<float> sums(4*size_t(w), 0.f); // r, g, b and weight, one row each
+      float *sr = &sums[0], *sg = sr + w, *sb = sg + w, *sw = sb + w;
+      const float *l = luma.data(), *z = depth.data(), *nx = nrm[0].data(), *ny = nrm[1].data(), *nz = nrm[2].data();
+      const float *cr = c[0].data(), *cg = c[1].data(), *cb = c[2].data();
+      const size_t p0 = size_t(y)*w;
+      for(int ty = -2; ty <= 2; ty++){
+        const int qy = y + ty*step;
+        if(qy < 0 || qy >= h) continue;
+        for(int tx = -2; tx <= 2; tx++){
+          const int dx = tx*step, x0 = std::max(0, -dx), x1 = std::min(w, w - dx); // taps that land inside the row
+          const size_t q0 = size_t(qy)*w + dx;
+          const float k = kernel[ty+2] * kernel[tx+2];
+          #pragma GCC ivdep // the planes never overlap - too many of them for gcc's runtime alias checks
+          for(int x = x0; x < x1; x++){
+            const size_t p = p0 + x, q = q0 + x;
+            const float dl = l[p] - l[q];
+            const float dn0 = nx[p] - nx[q], dn1 = ny[p] - ny[q], dn2 = nz[p] - nz[q];
+            const float dz = std::abs(z[p] - z[q]) / std::max(std::max(z[p], z[q]), 1e-6f);
+            const float wt = k * fast_exp_negative(dl*dl*inv_color + (dn0*dn0 + dn1*dn1 + dn2*dn2)*inv_normal + dz*inv_depth);
+            sr[x] += wt * cr[q]; sg[x] += wt * cg[q]; sb[x] += wt * cb[q];
+            sw[x] += wt;
+          }
+        }
+      }
+      float *outr = &next[0][p0], *outg = &next[1][p0], *outb = &next[2][p0];
+      #pragma GCC ivdep
+      for(int x = 0; x < w; x++){ // the center tap always has a weight, so the sum never vanishes
+        outr[x] = sr[x] / sw[x]; outg[x] = sg[x] / sw[x]; outb[x] = sb[x] / sw[x];
+      }
+    });
+    for(int ch = 0; ch < 3; ch++) std::swap(c[ch], next[ch]);
+  }
+
+  rows([&](int y){ // albedo back in
+    for(size_t i = size_t(y)*w; i < size_t(y+1)*w; i++)
+      for(int ch = 0; ch < 3; ch++){
+        const float a = g.albedo[i].values[ch];
+        color[i].values[ch] = a > ALBEDO_EPSILON ? c[ch][i] * a : c[ch][i];
+      }
+  });
+}
+
+#endif
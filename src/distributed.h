@@ -0,0 +1,222 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <deque>
+
+#include "renderer.h"
+#include "net.h"
+
+// distributed rendering - a coordinator hands each frame's tiles out over tcp to worker processes, which build the
+// same scene from the job's configuration and send back every tile's averaged linear pixels. seeded renders restart
+// their random stream per tile, so a tile comes back the same from whichever worker rendered it, and the assembled
+// image is the one a single process would have written. a worker that disconnects, or takes longer than
+// --worker_timeout over a batch, is dropped and its tiles go back in the queue; workers can join at any time. the
+// coordinator only assembles and saves, and never builds the scene.
+//   worker -> coordinator: hello (magic, threads)
+//   coordinator -> worker: the configuration, as config file text, then batches (frame, tile indices) and a stop
+//   worker -> coordinator: per batch, each tile's pixels at full precision in tile order, then its render counters
+
+constexpr uint32_t DISTRIBUTED_MAGIC = 0x414d4431; // "AMD1", and the same build on both ends - counters go over raw
+enum distributed_message : uint32_t { BATCH = 1, STOP = 2 };
+
+struct tile_rect{ int x0, y0, x1, y1; int pixels() const { return (x1 - x0) * (y1 - y0); } };
+inline tile_rect tile_area(const render_settings& rs, const unsigned long long index){ // as render_tile clips it
+  const int tiles_x = int(std::ceil(float(rs.xdim)/float(rs.tile)));
+  const int x0 = int(index % tiles_x) * rs.tile, y0 = int(index / tiles_x) * rs.tile;
+  return tile_rect{ x0, y0, std::min(x0 + rs.tile, rs.xdim), std::min(y0 + rs.tile, rs.ydim) };
+}
+
+class coordinator{
+public:
+  coordinator(const job_config& c) : job(c),
+    tiles_x(int(std::ceil(float(c.render.xdim)/float(c.render.tile)))), tiles_y(int(std::ceil(float(c.render.ydim)/float(c.render.tile)))) {}
+  // renders and saves every frame of the job, however many workers come and go - false if it can't start, or a frame
+  // couldn't be written
+  bool run(preview_server* preview){
+    if(!job.render.seed){ cerr << "distributed rendering needs a --seed, for every worker to build the same scene" << endl; return false; }
+    if(job.render.denoise > 0 || !job.render.aov.empty() || job.render.heatmap)
+      cerr << "distributed rendering only returns the image - denoise, aov and heatmap are ignored" << endl;
+    listener = listen_on(job.coordinator, false);
+    if(listener < 0){ cerr << "coordinator: can't listen on port " << job.coordinator << endl; return false; }
+    cout << "Coordinator on port " << job.coordinator << ", waiting for workers" << endl;
+    std::thread acceptor([this](){ accept_loop(); });
+
+    const size_t pixels = size_t(job.render.xdim) * job.render.ydim, count = size_t(tiles_x) * tiles_y;
+    linear.resize(pixels); bytes.assign(pixels * 4, 0);
+    bool written = true;
+    for(int frame = job.first_frame; frame <= job.last_frame; frame++){
+      const std::string filename = job.frame_filename(frame);
+      phase_timer t;
+      {
+        std::lock_guard<std::mutex> lock(m);
+        current = frame; finished.assign(count, 0); remaining = count; totals = render_stats(); requeued = 0;
+        for(unsigned long long i = 0; i < count; i++) queue.push_back(i);
+      }
+      if(preview) preview->begin_frame(filename, bytes.data(), job.render.xdim, job.render.ydim, job.render.tile, tiles_x, count, count, job.render.nsamples);
+      shown = preview;
+      work.notify_all();
+      {
+        std::unique_lock<std::mutex> lock(m);
+        done.wait(lock, [this](){ return remaining == 0; });
+      }
+      const phase_time elapsed = t.elapsed();
+      if(preview) preview->end_frame(false);
+      cout << "Writing \'" << filename << "\'" << endl;
+      if(!stbi_write_png(filename.c_str(), job.render.xdim, job.render.ydim, 4, bytes.data(), job.render.xdim * 4)){
+        cerr << "can't write \'" << filename << "\'" << endl; written = false;
+      }
+      if(!job.render.quiet){
+        std::lock_guard<std::mutex> lock(m);
+        cout << "  " << count << " tiles from " << workers_seen << " workers (" << live << " connected), " << requeued << " requeued from lost workers" << endl;
+        cout << "  " << elapsed.wall << " sec, " << totals.samples << " samples, " << totals.total_rays() << " rays ("
+             << totals.total_rays() / std::max(elapsed.wall, 0.001) << " rays/sec)" << endl;
+      }
+    }
+    { std::lock_guard<std::mutex> lock(m); stopping = true; }
+    work.notify_all();
+    acceptor.join();
+    for(auto& h : handlers) h.join();
+    close(listener);
+    return written;
+  }
+private:
+  const job_config job;
+  const int tiles_x, tiles_y;
+  int listener = -1;
+  std::vector<vec3> linear; std::vector<unsigned char> bytes; // the frame being assembled
+  preview_server* shown = nullptr;
+
+  std::mutex m; std::condition_variable work, done; // the tile queue, for the handlers, and frame completion
+  std::deque<unsigned long long> queue;   // tiles of the current frame not handed out
+  std::vector<unsigned char> finished;    // per tile of the current frame
+  size_t remaining = 0;
+  int current = 0;
+  bool stopping = false;
+  render_stats totals; unsigned long long requeued = 0; int workers_seen = 0, live = 0;
+  std::vector<std::thread> handlers;      // one per worker that connected, started by the acceptor only
+
+  void accept_loop(){
+    while(true){
+      { std::lock_guard<std::mutex> lock(m); if(stopping) return; }
+      const int s = accept_within(listener, 200);
+      if(s < 0) continue;
+      handlers.emplace_back([this, s](){ serve(s); close(s); });
+    }
+  }
+  void serve(const int s){ // one worker, until the job ends or the worker is lost
+    receive_timeout(s, job.worker_timeout); send_at_once(s);
+    uint32_t magic = 0, threads = 0;
+    if(!recv_value(s, magic) || magic != DISTRIBUTED_MAGIC || !recv_value(s, threads)) return;
+    const std::string text = config_string(job);
+    if(!send_value(s, DISTRIBUTED_MAGIC) || !send_value(s, uint64_t(text.size())) || !send_all(s, text.data(), text.size())) return;
+    { std::lock_guard<std::mutex> lock(m); workers_seen++; live++; }
+    const size_t batch_size = std::max<size_t>(1, 2 * threads); // a few tiles per thread keeps the worker busy between round trips
+    std::vector<unsigned long long> batch; std::vector<base_type> pixels;
+    while(true){
+      int frame;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        work.wait(lock, [this](){ return stopping || !queue.empty(); });
+        if(stopping){ live--; lock.unlock(); send_value(s, STOP); return; }
+        batch.clear();
+        while(!queue.empty() && batch.size() < batch_size){ batch.push_back(queue.front()); queue.pop_front(); }
+        frame = current;
+      }
+      bool ok = send_value(s, BATCH) && send_value(s, int32_t(frame)) && send_value(s, uint32_t(batch.size()))
+             && send_all(s, batch.data(), batch.size() * sizeof(batch[0]));
+      for(size_t k = 0; ok && k < batch.size(); k++){
+        const tile_rect a = tile_area(job.render, batch[k]);
+        pixels.resize(size_t(a.pixels()) * 3);
+        ok = recv_all(s, pixels.data(), pixels.size() * sizeof(base_type));
+        if(ok) store(a, pixels);
+      }
+      render_stats st;
+      ok = ok && recv_value(s, st);
+      std::lock_guard<std::mutex> lock(m);
+      if(!ok){ // the worker is gone, or too slow - its tiles go to the others
+        cerr << "lost a worker, requeueing " << batch.size() << " tiles" << endl;
+        for(auto i = batch.rbegin(); i != batch.rend(); i++) queue.push_front(*i);
+        requeued += batch.size(); live--;
+        work.notify_all();
+        return;
+      }
+      totals += st;
+      for(const unsigned long long index : batch){
+        if(finished[index]) continue;
+        finished[index] = 1; remaining--;
+        if(shown) shown->tile_done(index);
+      }
+      if(remaining == 0) done.notify_all();
+    }
+  }
+  void store(const tile_rect& a, const std::vector<base_type>& pixels){ // into the linear and tonemapped images - tiles don't overlap
+    size_t k = 0;
+    for(int y = a.y0; y < a.y1; y++)
+    for(int x = a.x0; x < a.x1; x++, k += 3){
+      vec3 col(pixels[k], pixels[k+1], pixels[k+2]);
+      linear[size_t(y) * job.render.xdim + x] = col;
+      tonemap_and_gamma(col, job.render.gamma);
+      unsigned char* out = &bytes[4 * (size_t(y) * job.render.xdim + x)];
+      for(int c = 0; c < 4; c++) out[c] = (c == 3) ? 255 : col.values[c] * 255.;
+    }
+  }
+};
+
+// renders tiles for the coordinator at local.worker until it says stop - false if it can't be reached, or the scene
+// it describes can't be built here
+inline bool run_worker(const job_config& local){
+  const size_t colon = local.worker.rfind(':');
+  if(colon == std::string::npos){ cerr << "--worker expects host:port" << endl; return false; }
+  const std::string host = local.worker.substr(0, colon); const int port = std::atoi(local.worker.substr(colon + 1).c_str());
+  int s = -1;
+  for(int attempt = 0; attempt < local.worker_timeout && s < 0; attempt++){ // the coordinator may not be up yet
+    s = connect_to(host, port);
+    if(s < 0) std::this_thread::sleep_for(std::chrono::seconds(1));
+  }
+  if(s < 0){ cerr << "can't reach a coordinator at " << local.worker << endl; return false; }
+  send_at_once(s);
+  uint32_t magic = 0; uint64_t length = 0;
+  if(!send_value(s, DISTRIBUTED_MAGIC) || !send_value(s, uint32_t(local.render.threads))
+     || !recv_value(s, magic) || magic != DISTRIBUTED_MAGIC || !recv_value(s, length)){ cerr << "no coordinator at " << local.worker << endl; close(s); return false; }
+  std::string text(length, '\0');
+  if(!recv_all(s, &text[0], length)){ close(s); return false; }
+  job_config job; std::stringstream config(text);
+  if(!load_config(job, config, "coordinator")){ close(s); return false; }
+  job.render.threads = local.render.threads; // this machine's, and nothing written or shown here
+  job.render.quiet = true; job.render.report_path.clear(); job.render.heatmap = false; job.render.preview = 0;
+  cout << "Rendering for " << local.worker << " on " << job.render.threads << " threads" << endl;
+
+  std::unique_ptr<renderer> r; int frame = 0; unsigned long long tiles = 0;
+  std::vector<unsigned long long> batch; std::vector<base_type> pixels;
+  while(true){
+    uint32_t type = 0;
+    if(!recv_value(s, type) || type == STOP) break;
+    int32_t f = 0; uint32_t count = 0;
+    if(type != BATCH || !recv_value(s, f) || !recv_value(s, count)){ cerr << "bad message from the coordinator" << endl; close(s); return false; }
+    batch.resize(count);
+    if(!recv_all(s, batch.data(), count * sizeof(batch[0]))) break;
+    if(!r || f != frame){ // the frame's scene, as main would have it - one moved scene, or a new one per frame
+      if(!r || !job.animate){ r.reset(new renderer(job.render)); if(!r->scene_ok){ close(s); return false; } }
+      if(job.animate) r->animate_to(f);
+      frame = f;
+    }
+    r->render_tiles(batch);
+    const std::vector<vec3>& image = r->linear_image();
+    bool ok = true;
+    for(const unsigned long long index : batch){
+      const tile_rect a = tile_area(job.render, index);
+      pixels.clear();
+      for(int y = a.y0; y < a.y1; y++)
+      for(int x = a.x0; x < a.x1; x++)
+        for(int c = 0; c < 3; c++) pixels.push_back(image[size_t(y) * job.render.xdim + x].values[c]);
+      ok = ok && send_all(s, pixels.data(), pixels.size() * sizeof(base_type));
+    }
+    if(!ok || !send_value(s, r->totals())) break;
+    tiles += count;
+  }
+  close(s);
+  cout << "Rendered " << tiles << " tiles" << endl;
+  return true;
+}
+
+#endif
@@ -0,0 +1,151 @@
+// incremental re-rendering and the primary hit cache, checked - a seeded scene is rendered, edited and rendered again
+// in incremental mode, and every render is compared tile by tile with a fresh full render of the same edited scene.
+// a redone tile has to match it exactly, and a clean one has to be left as it was and not show the edited primitive
+// before or after. clean tiles the full render gives differently (the edit's shadows and bounce light, which
+// incremental mode leaves for invalidate) are counted as stale. then the same edits go through a renderer with the
+// primary cache: rendering the same view again has to replay every camera ray and give the same image, a material
+// edit has to replay too, and geometry and camera changes have to drop the cache and give the full render's image
+//   usage: render_edits [--width w] [--height h] [--spp n] [--threads n]
+
+#include <functional>
+
+// geometry, camera and the tile renderer
+#include "renderer.h"
+
+// image output - renderer.h has the declarations, this compiles in the implementation
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+constexpr unsigned long long EDITS_SEED = 0xED175ULL;
+const vec3 EDITS_CAMERA = vec3(1.6, 0.8, 2.1);
+
+using edit = std::function<bool(renderer&)>;
+
+// tile index of two linear images of r's size, bit for bit
+bool same_tile(const renderer& r, const std::vector<vec3>& a, const std::vector<vec3>& b, const unsigned long long index){
+  const int tile = r.settings.tile, xdim = r.settings.xdim, ydim = r.settings.ydim;
+  const int x0 = int(index % r.num_tiles_x) * tile, y0 = int(index / r.num_tiles_x) * tile, x1 = std::min(x0 + tile, xdim);
+  for(int y = y0; y < std::min(y0 + tile, ydim); y++)
+    if(std::memcmp(&a[size_t(y) * xdim + x0], &b[size_t(y) * xdim + x0], (x1 - x0) * sizeof(vec3)) != 0) return false;
+  return true;
+}
+
+// whether primitive p is the first hit of any pixel of the tile, in either image's primitive aov
+bool tile_sees(const renderer& r, const aov_buffers& a, const aov_buffers& b, const int p, const unsigned long long index){
+  const int tile = r.settings.tile, xdim = r.settings.xdim, ydim = r.settings.ydim;
+  const int x0 = int(index % r.num_tiles_x) * tile, y0 = int(index / r.num_tiles_x) * tile;
+  for(int y = y0; y < std::min(y0 + tile, ydim); y++)
+  for(int x = x0; x < std::min(x0 + tile, xdim); x++)
+    if(a.primitive[size_t(y) * xdim + x] == p || b.primitive[size_t(y) * xdim + x] == p) return true;
+  return false;
+}
+
+// the primitive seen closest to the image center that doesn't emit, from the first render's primitive aov - a sphere
+// if there is one, the generated triangles stretch over most of the image
+size_t central_primitive(const renderer& r){
+  const aov_buffers& a = r.aov(); const int xdim = r.settings.xdim, ydim = r.settings.ydim;
+  size_t best = 0; long long closest = -1; bool sphere = false;
+  for(int y = 0; y < ydim; y++)
+  for(int x = 0; x < xdim; x++){
+    const int p = a.primitive[size_t(y) * xdim + x];
+    if(p < 0) continue;
+    const primitive_record rec = r.primitive(p);
+    const long long d = (2*x - xdim) * (2*x - xdim) + (2*y - ydim) * (2*y - ydim);
+    if(rec.material == 1 || (sphere && rec.type != SPHERE)) continue;
+    if(closest < 0 || d < closest || (!sphere && rec.type == SPHERE)){ best = p; closest = d; sphere = rec.type == SPHERE; }
+  }
+  return best;
+}
+
+int main(int argc, char const *argv[]){
+  render_settings rs;
+  rs.xdim = 240; rs.ydim = 135; rs.nsamples = 8;
+  for (int i = 1; i < argc; i++){ // every option takes a value
+    const std::string arg = argv[i];
+    if(i+1 >= argc){ cerr << "missing value for \'" << arg << "\'" << endl; return 2; }
+    try {
+      if(arg == "--width")        rs.xdim = std::stoi(argv[++i]);
+      else if(arg == "--height")  rs.ydim = std::stoi(argv[++i]);
+      else if(arg == "--spp")     rs.nsamples = std::stoi(argv[++i]);
+      else if(arg == "--threads") rs.threads = std::stoi(argv[++i]);
+      else { cerr << "unknown option \'" << arg << "\'" << endl; return 2; }
+    } catch(const std::exception& e) {
+      cerr << "bad value \'" << argv[i] << "\' for \'" << arg << "\'" << endl; return 2;
+    }
+  }
+  rs.seed = EDITS_SEED; rs.random_camera = false; rs.camera_position = EDITS_CAMERA; rs.quiet = true;
+  rs.aov = "primitive"; // to find something on screen to edit
+  render_settings full_settings = rs; rs.incremental = true;
+
+  renderer r(rs);
+  if(!r.scene_ok) return 1;
+  r.render();
+  const size_t target = central_primitive(r);
+  const primitive_record original = r.primitive(target);
+  cout << "Editing primitive " << target << " (" << (original.type == SPHERE ? "sphere" : original.type == TRIANGLE ? "triangle" : "instance")
+       << ", material " << original.material << ") of " << r.primitive_count() << ", " << rs.xdim << "x" << rs.ydim << " at " << rs.nsamples << " spp" << endl;
+
+  primitive_record recolored = original; recolored.material = original.material == 3 ? 2 : 3;
+  primitive_record moved = recolored; // every point of the geometry, a little to the side
+  const int points = original.type == SPHERE ? 1 : original.type == TRIANGLE ? 3 : 0;
+  for(int k = 0; k < points; k++) moved.data[3*k] += 0.05;
+  const std::vector<std::pair<std::string, edit>> steps = {
+    { "material", [&](renderer& x){ return x.edit_primitive(target, recolored); } },
+    { "move",     [&](renderer& x){ return x.edit_primitive(target, moved); } },
+    { "camera",   [&](renderer& x){ x.move_camera(EDITS_CAMERA * 1.1); return true; } },
+  };
+
+  cout << std::left << std::setw(10) << "edit" << std::right << std::setw(12) << "tiles" << std::setw(12) << "seconds"
+       << std::setw(12) << "full" << std::setw(8) << "stale" << std::setw(8) << "check" << endl;
+  bool failed = false;
+  std::vector<std::vector<vec3>> full_images; std::vector<double> full_seconds; // per step, for the primary cache too
+  for(size_t step = 0; step < steps.size(); step++){
+    const std::vector<vec3> before = r.linear_image(); const aov_buffers seen = r.aov();
+    if(!steps[step].second(r)) return 1;
+    r.render();
+    renderer fresh(full_settings); // the same edits so far, rendered from scratch
+    if(!fresh.scene_ok) return 1;
+    for(size_t k = 0; k <= step; k++) if(!steps[k].second(fresh)) return 1;
+    fresh.render();
+    full_images.push_back(fresh.linear_image()); full_seconds.push_back(fresh.render_phase_time().wall);
+
+    std::vector<unsigned char> redone(r.total_tile_count, 0);
+    for(const unsigned long long index : r.rendered_tiles()) redone[index] = 1;
+    unsigned long long wrong = 0, stale = 0;
+    for(unsigned long long index = 0; index < r.total_tile_count; index++){
+      const bool matches_full = same_tile(r, r.linear_image(), fresh.linear_image(), index);
+      if(redone[index]){ wrong += !matches_full; continue; }
+      wrong += !same_tile(r, r.linear_image(), before, index) || tile_sees(r, seen, fresh.aov(), int(target), index); // left as it was, and not needed
+      stale += !matches_full;
+    }
+    std::stringstream tiles; tiles << r.rendered_tiles().size() << "/" << r.total_tile_count;
+    cout << std::left << std::setw(10) << steps[step].first << std::right << std::setw(12) << tiles.str() << std::fixed << std::setprecision(3)
+         << std::setw(12) << r.render_phase_time().wall << std::setw(12) << fresh.render_phase_time().wall << std::defaultfloat
+         << std::setw(8) << stale << std::setw(8) << (wrong ? "FAILED" : "ok") << endl;
+    if(wrong){ cerr << "  " << wrong << " tiles differ from what they should hold" << endl; failed = true; }
+  }
+
+  render_settings cached_settings = full_settings; cached_settings.primary_cache = 64;
+  renderer p(cached_settings);
+  if(!p.scene_ok) return 1;
+  p.render();
+  const unsigned long long camera_samples = (unsigned long long)(rs.xdim) * rs.ydim * rs.nsamples;
+  cout << std::left << std::setw(10) << "cache" << std::right << std::setw(12) << "replayed" << std::setw(12) << "seconds"
+       << std::setw(12) << "full" << std::setw(8) << "" << std::setw(8) << "check" << endl;
+  for(size_t step = 0; step <= steps.size(); step++){ // a repeat of the first render, then the edits
+    const std::vector<vec3> before = p.linear_image(); const double first_seconds = p.render_phase_time().wall;
+    if(step > 0 && !steps[step-1].second(p)) return 1;
+    p.render();
+    const bool geometry = step > 1; // the move, and the camera after it - the first hits change
+    const unsigned long long replayed = p.totals().camera_replays;
+    const std::vector<vec3>& expected = step == 0 ? before : full_images[step-1];
+    // after a material edit the replayed jitter positions are the ones the earlier paths' random streams gave, not
+    // the ones this scene's would, so that image is a valid render but not the full render's bits
+    const bool compared = step != 1, ok = (geometry ? replayed == 0 : replayed == camera_samples) && (!compared || std::memcmp(p.linear_image().data(), expected.data(), expected.size() * sizeof(vec3)) == 0);
+    cout << std::left << std::setw(10) << (step ? steps[step-1].first : "again") << std::right << std::setw(12) << replayed << std::fixed << std::setprecision(3)
+         << std::setw(12) << p.render_phase_time().wall << std::setw(12) << (step ? full_seconds[step-1] : first_seconds) << std::defaultfloat
+         << std::setw(8) << "" << std::setw(8) << (ok ? (compared ? "ok" : "valid") : "FAILED") << endl;
+    if(!ok){ cerr << "  the primary cache was " << (geometry ? "kept over a change" : "not replayed") << ", or the image differs" << endl; failed = true; }
+  }
+  return failed ? 1 : 0;
+}
@@ -0,0 +1,235 @@
+#ifndef GRID_H
+#define GRID_H
+
+#include "bvh.h" // primitive_list, parallel_for, intersection
+
+// two level uniform grid - a coarse grid over the scene, where any cell holding more than a few references
+// gets a finer grid of its own. both levels are walked with a 3D-DDA. the build is a count, a prefix sum and
+// a scatter, all parallel over primitives or cells, so it is close to free next to a bvh build
+
+constexpr base_type GRID_TOP_DENSITY = 0.25;  // top level cells per primitive
+constexpr base_type GRID_CELL_DENSITY = 2.;  // second level cells per reference in the parent cell
+constexpr uint32_t GRID_SUBDIVIDE = 8;       // cells holding more references than this get a second level
+constexpr base_type GRID_REFERENCES = 8.;    // references per primitive a level may hold before it is made coarser
+constexpr int GRID_MAX_RESOLUTION = 128;     // per axis, per level
+constexpr int GRID_MAILBOX = 8;              // recently tested primitives skipped per ray
+
+struct grid_cell{ // references [first, first+count) - or with sub >= 0, a finer grid covering this cell
+  uint32_t first = 0, count = 0;
+  int32_t sub = -1;
+};
+
+struct uniform_grid{
+  aabb box;
+  int res[3] = {1, 1, 1};
+  vec3 cell_size, inv_cell_size;
+  std::vector<grid_cell> cells; // x fastest
+  std::vector<uint32_t> refs;   // primitive indices, grouped by cell
+
+  // resolution for about density*count cells over box, the same cell edge on every axis - flat boxes get
+  // a little thickness so the volume stays meaningful
+  void shape(const aabb& b, const size_t count, const base_type density){
+    box = b;
+    vec3 d = box.hi - box.lo;
+    const base_type thickness = std::max(std::max(d.values[0], d.values[1]), std::max(d.values[2], HIT_EPSILON)) * 1e-3;
+    for(int a = 0; a < 3; a++) d.values[a] = std::max(d.values[a], thickness);
+    const base_type edge = std::cbrt(d.values[0]*d.values[1]*d.values[2] / std::max(density * count, 1.));
+    for(int a = 0; a < 3; a++){
+      res[a] = std::clamp(int(d.values[a] / edge), 1, GRID_MAX_RESOLUTION);
+      cell_size.values[a] = d.values[a] / res[a];
+      inv_cell_size.values[a] = 1. / cell_size.values[a];
+    }
+    box.hi = box.lo + d;
+    cells.assign(size_t(res[0]) * res[1] * res[2], grid_cell());
+  }
+  size_t cell_count() const { return size_t(res[0]) * res[1] * res[2]; }
+  void cell_range(const aabb& b, int lo[3], int hi[3]) const { // cells touched by b, padded a little against rounding
+    for(int a = 0; a < 3; a++){
+      const base_type pad = 1e-9 * cell_size.values[a];
+      lo[a] = std::clamp(int((b.lo.values[a] - pad - box.lo.values[a]) * inv_cell_size.values[a]), 0, res[a]-1);
+      hi[a] = std::clamp(int((b.hi.values[a] + pad - box.lo.values[a]) * inv_cell_size.values[a]), 0, res[a]-1);
+    }
+  }
+  size_t cell_index(int x, int y, int z) const { return (size_t(z) * res[1] + y) * res[0] + x; }
+  aabb cell_box(int x, int y, int z) const {
+    aabb c; c.lo = box.lo + vec3(x, y, z) * cell_size; c.hi = c.lo + cell_size;
+    return c;
+  }
+
+  // 3D-DDA over the cells the ray passes in [tmin, tmax], in order - visit(cell, t_enter, t_exit) returns true to stop
+  template <typename F>
+  bool walk(const ray& r, const vec3& inv, base_type tmin, base_type tmax, const F& visit) const {
+    for(int a = 0; a < 3; a++){ // clip to the grid box
+      const base_type t0 = (box.lo.values[a] - r.origin.values[a]) * inv.values[a];
+      const base_type t1 = (box.hi.values[a] - r.origin.values[a]) * inv.values[a];
+      tmin = std::max(tmin, std::min(t0, t1)); tmax = std::min(tmax, std::max(t0, t1));
+    }
+    if(tmin > tmax) return false;
+    int cell[3], step[3]; base_type next[3], delta[3];
+    for(int a = 0; a < 3; a++){
+      const base_type p = r.origin.values[a] + r.direction.values[a] * tmin;
+      cell[a] = std::clamp(int((p - box.lo.values[a]) * inv_cell_size.values[a]), 0, res[a]-1);
+      if(r.direction.values[a] == 0.){ step[a] = 0; next[a] = DMAX_TRAVEL; delta[a] = DMAX_TRAVEL; continue; }
+      step[a] = r.direction.values[a] > 0. ? 1 : -1;
+      const base_type boundary = box.lo.values[a] + (cell[a] + (step[a] > 0 ? 1 : 0)) * cell_size.values[a];
+      next[a] = (boundary - r.origin.values[a]) * inv.values[a];
+      delta[a] = cell_size.values[a] * std::abs(inv.values[a]);
+    }
+    base_type t = tmin;
+    while(true){
+      const int a = (next[0] < next[1]) ? (next[0] < next[2] ? 0 : 2) : (next[1] < next[2] ? 1 : 2);
+      const base_type exit = std::min(next[a], tmax);
+      if(visit(cells[cell_index(cell[0], cell[1], cell[2])], t, exit)) return true;
+      if(next[a] >= tmax) return false;
+      cell[a] += step[a];
+      if(cell[a] < 0 || cell[a] >= res[a]) return false;
+      t = next[a]; next[a] += delta[a];
+    }
+  }
+};
+
+class grid{
+public:
+  void build(const primitive_list& prims, worker_pool* pool = nullptr){
+    clear();
+    const size_t n = prims.size();
+    if(n == 0) return;
+    std::vector<aabb> boxes(n);
+    const int workers = pool ? pool->size() : 1;
+    std::vector<aabb> partial(workers);
+    parallel_for(pool, n, [&](size_t b, size_t e, int id){
+      for(size_t i = b; i < e; i++){ boxes[i] = prims[i]->bounds(); partial[id].grow(boxes[i]); }
+    }, 1024);
+    aabb scene_box; for(const auto& p : partial) scene_box.grow(p);
+    std::vector<uint32_t> all(n); std::iota(all.begin(), all.end(), 0u);
+    fit(top, scene_box, all, boxes, GRID_TOP_DENSITY, pool);
+    fill(top, all, boxes, pool);
+
+    // second level, one grid per crowded cell - built in parallel, each on its own. cells whose references
+    // mostly cover the whole cell gain nothing from it and stay flat
+    std::vector<uint32_t> crowded;
+    for(uint32_t c = 0; c < top.cells.size(); c++)
+      if(top.cells[c].count > GRID_SUBDIVIDE) crowded.push_back(c);
+    std::vector<uniform_grid> built(crowded.size());
+    parallel_for(pool, crowded.size(), [&](size_t b, size_t e, int){
+      for(size_t i = b; i < e; i++){
+        const uint32_t c = crowded[i];
+        const int x = c % top.res[0], y = (c / top.res[0]) % top.res[1], z = c / (top.res[0] * top.res[1]);
+        const std::vector<uint32_t> members(top.refs.begin() + top.cells[c].first, top.refs.begin() + top.cells[c].first + top.cells[c].count);
+        if(fit(built[i], top.cell_box(x, y, z), members, boxes, GRID_CELL_DENSITY, nullptr) > 1) fill(built[i], members, boxes, nullptr);
+      }
+    });
+    for(size_t i = 0; i < crowded.size(); i++)
+      if(built[i].cell_count() > 1){ top.cells[crowded[i]].sub = int32_t(subs.size()); subs.push_back(std::move(built[i])); }
+    primitive_total = n;
+  }
+  void clear(){ top = uniform_grid(); subs.clear(); primitive_total = 0; }
+  bool valid_for(const primitive_list& prims) const { return primitive_total && primitive_total == prims.size(); }
+  aabb bounds() const { return top.box; }
+  size_t level_count() const { return primitive_total ? 1 + !subs.empty() : 0; }
+  size_t cell_count() const { size_t n = top.cells.size(); for(const auto& s : subs) n += s.cells.size(); return n; }
+  size_t reference_count() const { size_t n = top.refs.size(); for(const auto& s : subs) n += s.refs.size(); return n; }
+  size_t memory_usage() const {
+    size_t bytes = top.cells.size() * sizeof(grid_cell) + top.refs.size() * sizeof(uint32_t);
+    for(const auto& s : subs) bytes += s.cells.size() * sizeof(grid_cell) + s.refs.size() * sizeof(uint32_t);
+    return bytes;
+  }
+
+  hitrecord intersect(const ray& r, const primitive_list& prims, render_stats* stats=nullptr) const {
+    hitrecord h;
+    base_type current_min = DMAX_TRAVEL;
+    const vec3 inv(1./r.direction.values[0], 1./r.direction.values[1], 1./r.direction.values[2]);
+    uint32_t mailbox[GRID_MAILBOX]; int next_box = 0; // primitives spanning several cells are tested once
+    std::fill(mailbox, mailbox + GRID_MAILBOX, UINT32_MAX);
+    auto test = [&](const uniform_grid& g, const grid_cell& c, base_type exit){ // references in one cell - true once the closest hit is known
+      for(uint32_t k = c.first; k < c.first + c.count; k++){
+        const uint32_t p = g.refs[k];
+        if(std::find(mailbox, mailbox + GRID_MAILBOX, p) != mailbox + GRID_MAILBOX) continue;
+        mailbox[next_box] = p; next_box = (next_box + 1) % GRID_MAILBOX;
+        if(stats) stats->intersection_tests++;
+        hitrecord temp = prims[p]->intersect(r);
+        (temp.instance_index < 0 ? temp.primitive_index : temp.instance_index) = p;
+        if(temp.dtransit < DMAX_TRAVEL && temp.dtransit > 0. && temp.dtransit < current_min){
+          current_min = temp.dtransit;
+          h = temp;
+        }
+      }
+      return current_min <= exit; // a hit past this cell could still lose to one further along
+    };
+    top.walk(r, inv, 0., DMAX_TRAVEL, [&](const grid_cell& c, base_type enter, base_type exit){
+      if(c.sub < 0) return test(top, c, exit);
+      const uniform_grid& s = subs[c.sub];
+      s.walk(r, inv, enter, exit, [&](const grid_cell& sc, base_type, base_type sub_exit){ return test(s, sc, sub_exit); });
+      return current_min <= exit;
+    });
+    return h;
+  }
+  bool intersect_any(const ray& r, const base_type tmax, const primitive_list& prims, render_stats* stats=nullptr) const { // first hit in (0, tmax)
+    const vec3 inv(1./r.direction.values[0], 1./r.direction.values[1], 1./r.direction.values[2]);
+    auto test = [&](const uniform_grid& g, const grid_cell& c){
+      for(uint32_t k = c.first; k < c.first + c.count; k++){
+        if(stats) stats->intersection_tests++;
+        const hitrecord temp = prims[g.refs[k]]->intersect(r);
+        if(temp.dtransit > 0. && temp.dtransit < tmax) return true;
+      }
+      return false;
+    };
+    return top.walk(r, inv, 0., tmax, [&](const grid_cell& c, base_type enter, base_type exit){
+      if(c.sub < 0) return test(top, c);
+      const uniform_grid& s = subs[c.sub];
+      return s.walk(r, inv, enter, exit, [&](const grid_cell& sc, base_type, base_type){ return test(s, sc); });
+    });
+  }
+
+private:
+  uniform_grid top;
+  std::vector<uniform_grid> subs;
+  size_t primitive_total = 0;
+
+  // shapes g over box for members, coarsening from density until the references fit the budget - returns the cell count
+  static size_t fit(uniform_grid& g, const aabb& box, const std::vector<uint32_t>& members, const std::vector<aabb>& boxes, base_type density, worker_pool* pool){
+    while(true){
+      g.shape(box, members.size(), density);
+      if(g.cell_count() == 1) return 1;
+      std::atomic<uint64_t> references{0};
+      parallel_for(pool, members.size(), [&](size_t b, size_t e, int){
+        uint64_t local = 0;
+        for(size_t i = b; i < e; i++){
+          int lo[3], hi[3]; g.cell_range(boxes[members[i]], lo, hi);
+          local += uint64_t(hi[0]-lo[0]+1) * (hi[1]-lo[1]+1) * (hi[2]-lo[2]+1);
+        }
+        references += local;
+      }, 1024);
+      if(references <= GRID_REFERENCES * members.size()) return g.cell_count();
+      density *= 0.25;
+    }
+  }
+
+  // bins members into g's cells by box overlap - count, prefix sum, scatter, then each cell sorted so the
+  // layout does not depend on scheduling
+  static void fill(uniform_grid& g, const std::vector<uint32_t>& members, const std::vector<aabb>& boxes, worker_pool* pool){
+    std::vector<std::atomic<uint32_t>> counts(g.cells.size());
+    for(auto& c : counts) c.store(0, std::memory_order_relaxed);
+    auto each_cell = [&](uint32_t p, auto f){
+      int lo[3], hi[3]; g.cell_range(boxes[p], lo, hi);
+      for(int z = lo[2]; z <= hi[2]; z++) for(int y = lo[1]; y <= hi[1]; y++) for(int x = lo[0]; x <= hi[0]; x++) f(g.cell_index(x, y, z));
+    };
+    parallel_for(pool, members.size(), [&](size_t b, size_t e, int){
+      for(size_t i = b; i < e; i++) each_cell(members[i], [&](size_t c){ counts[c].fetch_add(1, std::memory_order_relaxed); });
+    }, 1024);
+    uint32_t total = 0;
+    for(size_t c = 0; c < g.cells.size(); c++){
+      g.cells[c].first = total; g.cells[c].count = counts[c].load(std::memory_order_relaxed); total += g.cells[c].count;
+      counts[c].store(g.cells[c].first, std::memory_order_relaxed); // reused as the scatter cursor
+    }
+    g.refs.resize(total);
+    parallel_for(pool, members.size(), [&](size_t b, size_t e, int){
+      for(size_t i = b; i < e; i++) each_cell(members[i], [&](size_t c){ g.refs[counts[c].fetch_add(1, std::memory_order_relaxed)] = members[i]; });
+    }, 1024);
+    parallel_for(pool, g.cells.size(), [&](size_t b, size_t e, int){
+      for(size_t c = b; c < e; c++) std::sort(g.refs.begin() + g.cells[c].first, g.refs.begin() + g.cells[c].first + g.cells[c].count);
+    }, 1024);
+  }
+};
+
+#endif
@@ -0,0 +1,228 @@
+#ifndef GUIDING_H
+#define GUIDING_H
+
+#include <array>
+#include <atomic>
+
+#include "primitives.h" // aabb
+
+// path guiding with an SD-tree (Müller et al. 2017) - a binary tree over space, each leaf holding a quadtree over
+// directions that learns where the light arriving in that region comes from. training runs the image a few times
+// at doubling sample counts; each pass samples bounces from the previous pass's trees and records what its paths
+// found into new ones, then leaves with many records are split in space and quadtree cells holding much of the
+// energy are split in direction. each region keeps a tree per major normal direction and records are weighted by
+// the cosine to the surface, so what a tree learns is close to the diffuse bsdf times the light, not the light alone.
+// the records are atomic integer adds, so training needs no locks or per thread
+// copies, and the sums don't depend on which thread added what first - seeded renders stay schedule independent
+
+constexpr int GUIDE_MAX_DEPTH = 20;               // quadtree levels
+constexpr double GUIDE_SPLIT_FRACTION = 0.01;     // a quadtree cell with more of its leaf's energy than this is split
+constexpr double GUIDE_SPATIAL_SAMPLES = 12000.;  // records a leaf may take in a 1 spp pass before it splits, times sqrt(spp)
+constexpr double GUIDE_FIXED_POINT = 1 << 16;     // recorded energy is summed in these integer steps
+constexpr double GUIDE_MAX_RECORD = 1e8;          // single records are clamped here, so a sum can't overflow
+constexpr unsigned long long GUIDE_MIN_RECORDS = 256; // fewer than this in a pass, and a region is left to the bsdf - a few
+                                                      // records would make a few narrow spikes
+
+// directions as points in the unit square, by cos(theta) and phi - equal areas on both, so densities differ by 4 pi
+inline vec2 direction_to_square(const vec3& d){
+  base_type phi = std::atan2(d.values[1], d.values[0]);
+  if(phi < 0.) phi += 2. * pi;
+  return vec2(std::clamp((d.values[2] + 1.) / 2., 0., 1.), std::clamp(phi / (2. * pi), 0., 1.));
+}
+inline vec3 square_to_direction(const vec2& p){
+  const base_type cos_t = 2. * p.values[0] - 1., sin_t = std::sqrt(std::max(1. - cos_t*cos_t, 0.)), phi = 2. * pi * p.values[1];
+  return vec3(sin_t * std::cos(phi), sin_t * std::sin(phi), cos_t);
+}
+
+class direction_tree{ // quadtree over the square - child quadrant q covers x half q&1, y half q>>1
+public:
+  direction_tree(){ sampling.push_back(empty_node()); building.push_back(empty_node()); allocate(); }
+  direction_tree(const direction_tree& o) : sampling(o.sampling), building(o.building), total(o.total), learned_from(o.learned_from) { // energies included
+    allocate();
+    for(size_t i = 0; i < 4*building.size(); i++) sums[i].store(o.sums[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    records.store(o.records.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  }
+  bool trained() const { return total > 0. && learned_from >= GUIDE_MIN_RECORDS; }
+  unsigned long long record_count() const { return records.load(std::memory_order_relaxed); }
+  size_t node_count() const { return sampling.size(); }
+
+  vec3 sample(base_type u1, base_type u2) const { // proportional to the learned energy, uniform inside a leaf cell
+    vec2 origin(0.); base_type size = 1.; uint32_t n = 0;
+    while(true){
+      const std::array<double, 4>& s = sampling[n].energy;
+      const double sum = s[0] + s[1] + s[2] + s[3];
+      if(sum <= 0.) break; // nothing learned here, uniform over this cell
+      const double pl = (s[0] + s[2]) / sum; int qx = 0, qy = 0;
+      if(u1 < pl){ u1 = u1 / pl; } else { u1 = (u1 - pl) / (1. - pl); qx = 1; }
+      const double a = s[qx], b = s[qx+2];
+      if(a + b <= 0.) break;
+      const double pb = a / (a + b);
+      if(u2 < pb){ u2 = u2 / pb; } else { u2 = (u2 - pb) / (1. - pb); qy = 1; }
+      u1 = std::min(u1, 1. - 1e-12); u2 = std::min(u2, 1. - 1e-12);
+      size /= 2.; origin = origin + vec2(qx * size, qy * size);
+      const uint32_t child = sampling[n].child[qx + 2*qy];
+      if(!child) break;
+      n = child;
+    }
+    return square_to_direction(origin + vec2(u1 * size, u2 * size));
+  }
+  base_type pdf(const vec3& d) const { // solid angle density of sample()
+    vec2 p = direction_to_square(d); base_type density = 1.; uint32_t n = 0;
+    while(true){
+      const std::array<double, 4>& s = sampling[n].energy;
+      const double sum = s[0] + s[1] + s[2] + s[3];
+      if(sum <= 0.) break;
+      const int q = quadrant(p);
+      density *= 4. * s[q] / sum;
+      if(!sampling[n].child[q] || density <= 0.) break;
+      n = sampling[n].child[q];
+    }
+    return density / (4. * pi);
+  }
+
+  void record(const vec3& d, double energy){ // from any thread
+    records.fetch_add(1, std::memory_order_relaxed);
+    if(!(energy > 0.)) return; // also drops nan
+    const uint64_t steps = uint64_t(std::min(energy, GUIDE_MAX_RECORD) * GUIDE_FIXED_POINT + 0.5);
+    if(!steps) return;
+    vec2 p = direction_to_square(d); uint32_t n = 0;
+    while(true){
+      const int q = quadrant(p);
+      sums[4*n + q].fetch_add(steps, std::memory_order_relaxed);
+      if(!building[n].child[q]) return;
+      n = building[n].child[q];
+    }
+  }
+  // the recorded energy becomes the sampling distribution, and recording starts over on a layout split where a
+  // cell held more than GUIDE_SPLIT_FRACTION of the energy and merged where it held less. not thread safe
+  void refine(){
+    uint64_t found = 0;
+    for(int q = 0; q < 4; q++) found += sums[q].load(std::memory_order_relaxed);
+    if(!found){ records = 0; return; } // nothing recorded - keep what was learned before
+    learned_from = records;
+    sampling = building;
+    for(size_t n = 0; n < building.size(); n++)
+      for(int q = 0; q < 4; q++) sampling[n].energy[q] = sums[4*n + q].load(std::memory_order_relaxed) / GUIDE_FIXED_POINT;
+    const std::array<double, 4>& root = sampling[0].energy;
+    total = root[0] + root[1] + root[2] + root[3];
+    building.assign(1, empty_node());
+    split(0, 0, 1);
+    allocate(); records = 0;
+  }
+
+private:
+  struct node{ std::array<uint32_t, 4> child; std::array<double, 4> energy; }; // child 0 is a leaf cell, the root is never a child
+  std::vector<node> sampling, building; // the distribution learned last pass, and the layout this pass records into
+  std::unique_ptr<std::atomic<uint64_t>[]> sums; // 4 per building node
+  std::atomic<unsigned long long> records{0};
+  double total = 0.;
+  unsigned long long learned_from = 0; // records behind the sampling distribution
+
+  static node empty_node(){ node n; n.child.fill(0); n.energy.fill(0.); return n; }
+  static int quadrant(vec2& p){ // and p rescaled into it
+    const int qx = p.values[0] >= 0.5, qy = p.values[1] >= 0.5;
+    p = vec2(std::min(p.values[0] * 2. - qx, 1.), std::min(p.values[1] * 2. - qy, 1.));
+    return qx + 2*qy;
+  }
+  void allocate(){
+    sums.reset(new std::atomic<uint64_t>[4*building.size()]);
+    for(size_t i = 0; i < 4*building.size(); i++) sums[i].store(0, std::memory_order_relaxed);
+  }
+  // fills building node b to match sampling node s (-1 for none - a cell the old layout didn't split), giving
+  // cells with enough energy children of their own. cells the old layout didn't have get an even share
+  void split(uint32_t b, int s, int depth, const double spread = 0.){
+    for(int q = 0; q < 4; q++){
+      const int sc = s >= 0 && sampling[s].child[q] ? int(sampling[s].child[q]) : -1;
+      const double e = s >= 0 ? sampling[s].energy[q] : spread;
+      if(depth >= GUIDE_MAX_DEPTH || e <= total * GUIDE_SPLIT_FRACTION) continue;
+      const uint32_t c = uint32_t(building.size()); building.push_back(empty_node());
+      building[b].child[q] = c;
+      split(c, sc, depth + 1, e / 4.);
+    }
+  }
+};
+
+class guide_tree{ // binary tree over a cube around the scene, halving x, y, z in turn, a direction_tree per leaf
+public:
+  void reset(const aabb& bounds){
+    const vec3 extent = bounds.hi - bounds.lo;
+    const base_type side = std::max(std::max(extent.values[0], extent.values[1]), std::max(extent.values[2], HIT_EPSILON)) * (1. + 1e-6);
+    lo = bounds.centroid() - vec3(side / 2.); scale = 1. / side;
+    nodes.assign(1, node()); nodes[0].leaf = 0;
+    leaves.clear(); leaves.push_back(std::make_unique<region>());
+    iterations = 0;
+  }
+  bool trained() const { return iterations > 0; }
+  int iteration_count() const { return iterations; }
+  size_t leaf_count() const { return leaves.size(); }
+  size_t direction_nodes() const { size_t n = 0; for(const auto& l : leaves) for(const auto& t : l->side) n += t.node_count(); return n; }
+
+  // the tree for surfaces at p, clamped into the cube, facing n's way
+  direction_tree* at(const vec3& p, const vec3& n) const {
+    vec3 u = (p - lo) * scale; int i = 0;
+    for(int a = 0; a < 3; a++) u.values[a] = std::clamp(u.values[a], 0., 1.);
+    for(int depth = 0; nodes[i].leaf < 0; depth++){
+      const int axis = depth % 3;
+      const int c = u.values[axis] >= 0.5;
+      u.values[axis] = std::min(u.values[axis] * 2. - c, 1.);
+      i = nodes[i].child[c];
+    }
+    int axis = 0;
+    for(int a = 1; a < 3; a++) if(std::abs(n.values[a]) > std::abs(n.values[axis])) axis = a;
+    return &leaves[nodes[i].leaf]->side[2*axis + (n.values[axis] < 0.)];
+  }
+  // after a training pass of spp samples per pixel - leaves that took too many records are split, each half
+  // starting from a copy of the parent, then every quadtree refines
+  void refine(int spp){
+    const double threshold = GUIDE_SPATIAL_SAMPLES * std::sqrt(double(spp));
+    const size_t count = nodes.size();
+    for(size_t n = 0; n < count; n++)
+      if(nodes[n].leaf >= 0) split(int(n), depth_of(int(n)), leaves[nodes[n].leaf]->record_count(), threshold);
+    for(auto& l : leaves) for(auto& t : l->side) t.refine();
+    iterations++;
+  }
+
+private:
+  struct node{ int child[2] = { -1, -1 }; int leaf = -1, parent = -1; };
+  std::vector<node> nodes;
+  struct region{ // one tree per major normal direction, so the sides of a thin object or a corner don't share
+    direction_tree side[6];
+    unsigned long long record_count() const { unsigned long long n = 0; for(const auto& t : side) n += t.record_count(); return n; }
+  };
+  std::vector<std::unique_ptr<region>> leaves;
+  vec3 lo; base_type scale = 1.;
+  int iterations = 0;
+
+  int depth_of(int n) const { int d = 0; while(nodes[n].parent >= 0){ n = nodes[n].parent; d++; } return d; }
+  void split(int n, int depth, double records, double threshold){ // records are assumed to halve with each split
+    if(records <= threshold || depth >= 60) return;
+    const int leaf = nodes[n].leaf;
+    for(int c = 0; c < 2; c++){
+      node child; child.parent = n;
+      child.leaf = c ? int(leaves.size()) : leaf;
+      if(c) leaves.push_back(std::make_unique<region>(*leaves[leaf]));
+      nodes[n].child[c] = int(nodes.size()); nodes.push_back(child);
+    }
+    nodes[n].leaf = -1;
+    for(int c = 0; c < 2; c++) split(nodes[n].child[c], depth + 1, records / 2., threshold);
+  }
+};
+
+// a path's guided vertices - once the path ends, each one records the light that arrived along its bounce
+// direction, per unit of throughput, times the cosine there, over the density that direction was sampled with
+class guide_path{
+public:
+  void begin(){ vertices.clear(); }
+  // weight is the throughput's luminance after the bounce, gathered the path's light before it
+  void add(direction_tree* tree, const vec3& direction, base_type weight, base_type pdf, base_type cosine, base_type gathered){
+    if(tree && pdf > 0. && weight > 0.) vertices.push_back({ tree, direction, cosine / (weight * pdf), gathered });
+  }
+  void finish(base_type gathered){
+    for(const vertex& v : vertices) v.tree->record(v.direction, (gathered - v.gathered) * v.scale);
+  }
+private:
+  struct vertex{ direction_tree* tree; vec3 direction; base_type scale, gathered; };
+  std::vector<vertex> vertices;
+};
+
+#endif
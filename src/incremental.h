@@ -0,0 +1,48 @@
+#ifndef INCREMENTAL_H
+#define INCREMENTAL_H
+
+#include "scene.h"
+
+// incremental re-rendering - which tiles an edit can change since they were last rendered. a render in incremental
+// mode keeps the image and redoes only the dirty tiles, each from its own seed, so a clean tile stays what a full
+// render would give it. a camera move dirties every tile. a primitive edit dirties the tiles under its screen space
+// bounds, before and after, which covers every camera ray that could hit it either way - but not the shadows,
+// reflections or bounce light it changes elsewhere, which wait for a full render. emitters light the whole image,
+// so edits to them dirty all of it
+
+class tile_set{
+public:
+  void reset(int tiles_x, int tiles_y, int tile_size){ nx = tiles_x; ny = tiles_y; tile = tile_size; dirty.assign(size_t(nx) * ny, 1); }
+  void mark_all(){ std::fill(dirty.begin(), dirty.end(), 1); }
+  void clear(){ std::fill(dirty.begin(), dirty.end(), 0); }
+  // the tiles that box covers as c sees it, a pixel wider on each side for rounding - all of them if part of it is
+  // behind the camera, where its projection has no bound
+  void mark(const aabb& box, const camera& c){
+    if(box.empty()) return;
+    base_type lo[2] = { DMAX_TRAVEL, DMAX_TRAVEL }, hi[2] = { -DMAX_TRAVEL, -DMAX_TRAVEL };
+    for(int k = 0; k < 8; k++){
+      const vec3 corner((k & 1 ? box.hi : box.lo).values[0], (k & 2 ? box.hi : box.lo).values[1], (k & 4 ? box.hi : box.lo).values[2]);
+      vec2 p;
+      if(!c.project(corner, p)){ mark_all(); return; }
+      for(int a = 0; a < 2; a++){ lo[a] = std::min(lo[a], p.values[a]); hi[a] = std::max(hi[a], p.values[a]); }
+    }
+    const int limit[2] = { nx * tile, ny * tile };
+    int first[2], last[2];
+    for(int a = 0; a < 2; a++){
+      if(hi[a] < -1. || lo[a] > limit[a] + 1.) return; // off screen
+      first[a] = int(std::max(base_type(0.), std::floor(lo[a]) - 1.)) / tile;
+      last[a] = int(std::min(base_type(limit[a] - 1), std::floor(hi[a]) + 1.)) / tile;
+    }
+    for(int y = first[1]; y <= last[1]; y++)
+    for(int x = first[0]; x <= last[0]; x++)
+      dirty[size_t(y) * nx + x] = 1;
+  }
+  bool operator[](size_t index) const { return dirty[index]; }
+  size_t count() const { return std::count(dirty.begin(), dirty.end(), 1); }
+  size_t size() const { return dirty.size(); }
+private:
+  std::vector<unsigned char> dirty; // per tile, in tile index order
+  int nx = 0, ny = 0, tile = 1;
+};
+
+#endif
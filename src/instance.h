@@ -0,0 +1,106 @@
+#ifndef INSTANCE_H
+#define INSTANCE_H
+
+#include "scene.h"
+
+// object instancing - an object is a scene with its own acceleration structure (the bottom level), and each instance
+// is a primitive holding a transform and a pointer to it, so the scene's structure over contents is the top level.
+// memory goes with the unique objects, each further copy is just the instance
+
+struct affine{ // 3x4 row major - linear part in the first three columns, translation in the last
+  base_type m[3][4] = {{1.,0.,0.,0.}, {0.,1.,0.,0.}, {0.,0.,1.,0.}};
+
+  // scale, then rotate by angle about axis (Rodrigues), then translate
+  static affine make(const vec3& translate, const vec3& axis, const base_type angle, const base_type scale){
+    const vec3 k = normalize(axis);
+    const base_type c = std::cos(angle), s = std::sin(angle);
+    const base_type x = k.values[0], y = k.values[1], z = k.values[2];
+    const base_type r[3][3] = {{c + x*x*(1.-c),   x*y*(1.-c) - z*s, x*z*(1.-c) + y*s},
+                               {y*x*(1.-c) + z*s, c + y*y*(1.-c),   y*z*(1.-c) - x*s},
+                               {z*x*(1.-c) - y*s, z*y*(1.-c) + x*s, c + z*z*(1.-c)}};
+    affine a;
+    for(int i = 0; i < 3; i++){
+      for(int j = 0; j < 3; j++) a.m[i][j] = r[i][j] * scale;
+      a.m[i][3] = translate.values[i];
+    }
+    return a;
+  }
+  vec3 point(const vec3& p) const { return vector(p) + vec3(m[0][3], m[1][3], m[2][3]); }
+  vec3 vector(const vec3& v) const {
+    return vec3(m[0][0]*v.values[0] + m[0][1]*v.values[1] + m[0][2]*v.values[2],
+                m[1][0]*v.values[0] + m[1][1]*v.values[1] + m[1][2]*v.values[2],
+                m[2][0]*v.values[0] + m[2][1]*v.values[1] + m[2][2]*v.values[2]);
+  }
+  vec3 transposed(const vec3& v) const { // transpose of the linear part - on the inverse, this carries normals forward
+    return vec3(m[0][0]*v.values[0] + m[1][0]*v.values[1] + m[2][0]*v.values[2],
+                m[0][1]*v.values[0] + m[1][1]*v.values[1] + m[2][1]*v.values[2],
+                m[0][2]*v.values[0] + m[1][2]*v.values[1] + m[2][2]*v.values[2]);
+  }
+  affine inverse() const { // cofactor inverse of the linear part, translation carried through it
+    affine inv;
+    const base_type det = m[0][0]*(m[1][1]*m[2][2] - m[1][2]*m[2][1])
+                        - m[0][1]*(m[1][0]*m[2][2] - m[1][2]*m[2][0])
+                        + m[0][2]*(m[1][0]*m[2][1] - m[1][1]*m[2][0]);
+    for(int i = 0; i < 3; i++)
+      for(int j = 0; j < 3; j++){ // inv[i][j] = cofactor[j][i] / det
+        const int r0 = (j+1)%3, r1 = (j+2)%3, c0 = (i+1)%3, c1 = (i+2)%3;
+        inv.m[i][j] = (m[r0][c0]*m[r1][c1] - m[r0][c1]*m[r1][c0]) / det;
+      }
+    const vec3 t = inv.vector(vec3(m[0][3], m[1][3], m[2][3]));
+    for(int i = 0; i < 3; i++) inv.m[i][3] = -t.values[i];
+    return inv;
+  }
+};
+
+class instance : public primitive {
+public:
+  instance(std::shared_ptr<const scene> o, const affine& transform) : object(o), to_world(transform), to_object(transform.inverse()) {
+    material_index = -1; // materials come from the object's primitives
+  }
+  hitrecord intersect(ray r) const override {
+    // the direction is not renormalized, so distances along the ray are the same in both spaces
+    const ray local{ to_object.point(r.origin), to_object.vector(r.direction) };
+    hitrecord h = object->ray_query(local);
+    if(h.dtransit < DMAX_TRAVEL){
+      h.position = to_world.point(h.position);
+      h.normal = normalize(to_object.transposed(h.normal));
+      h.instance_index = 0; // marks an instance hit, the caller fills in which one
+    }
+    return h;
+  }
+  aabb bounds() const override { // the object box's corners, carried to world space
+    const aabb local = object->accel->bounds(); aabb b;
+    for(int corner = 0; corner < 8; corner++)
+      b.grow(to_world.point(vec3((corner & 1) ? local.hi.values[0] : local.lo.values[0],
+                                 (corner & 2) ? local.hi.values[1] : local.lo.values[1],
+                                 (corner & 4) ? local.hi.values[2] : local.lo.values[2])));
+    return b;
+  }
+  primitive_record record() const override {
+    primitive_record r{ INSTANCE, material_index, object->accel->content_hash(), {} };
+    for(int i = 0; i < 3; i++) for(int j = 0; j < 4; j++) r.data[4*i+j] = to_world.m[i][j];
+    return r;
+  }
+  void update(const primitive_record& r) override {
+    for(int i = 0; i < 3; i++) for(int j = 0; j < 4; j++) to_world.m[i][j] = r.data[4*i+j];
+    to_object = to_world.inverse();
+  }
+private:
+  std::shared_ptr<const scene> object;
+  affine to_world, to_object;
+};
+
+// appends count seeded random placements of object to s - it gets a bvh built first, if it has no structure
+inline void scatter_instances(scene& s, std::shared_ptr<scene> object, long long count, unsigned long long seed=0, const std::string& cache_dir=""){
+  if(object->contents.empty() || count < 1) return;
+  if(!object->accel || !object->accel->valid_for(object->contents)){ accel_settings a; a.cache_dir = cache_dir; object->build_accel("bvh", a); }
+  std::random_device r;
+  std::seed_seq q = seed ? std::seed_seq{uint32_t(seed), uint32_t(seed >> 32), 0x1257u} : std::seed_seq{r(), r(), r(), r(), r(), r(), r(), r(), r()};
+  auto gen = std::make_shared<std::mt19937_64>(q);
+  const base_type size = 0.6 / std::cbrt(base_type(count)); // keeps the total volume about constant
+  for(long long i = 0; i < count; i++)
+    s.contents.push_back(std::make_shared<instance>(object,
+      affine::make(random_vector(gen) * 2., random_unit_vector(gen), rng(gen) * 2. * pi, size * (0.5 + rng(gen)))));
+}
+
+#endif
@@ -0,0 +1,262 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "bvh.h"  // primitive_list
+#include "bsdf.h" // emission, orthonormal_basis
+
+// next event estimation over the emissive primitives (material 1) - a shading point picks one light, then a point
+// on it, and the renderer traces a shadow ray there. the picking goes down a light bvh (Conty Estevez & Kulla 2018):
+// every node bounds its lights' positions, their total power and the cone their emission leaves in, and at each
+// node the child whose bounds could send more light toward the point is taken proportionally more often.
+// O(log n) per pick, and pdf() walks the same path back up, so a bsdf sampled ray that lands on a light can be
+// weighed against the chance of having sampled it this way. instanced geometry is never sampled, only hit
+
+constexpr int LIGHT_BINS = 12;             // split candidates per axis when building the light bvh
+constexpr base_type SHADOW_EPSILON = 1e-7; // shadow rays start this far off the surface and stop this far short of the light
+
+enum light_mode{ LIGHTS_NONE, LIGHTS_UNIFORM, LIGHTS_BVH, LIGHT_MODE_COUNT };
+constexpr const char* LIGHT_MODE_NAMES[LIGHT_MODE_COUNT] = { "none", "uniform", "bvh" };
+
+inline bool parse_light_mode(const std::string& name, light_mode& m){
+  for(int i = 0; i < LIGHT_MODE_COUNT; i++)
+    if(name == LIGHT_MODE_NAMES[i]){ m = light_mode(i); return true; }
+  return false;
+}
+
+inline base_type power_heuristic(base_type a, base_type b){ return a*a / (a*a + b*b); } // mis weight of a against b, with beta 2
+
+struct direction_cone{ // every direction within theta of axis, stored as cos(theta) - empty below -1
+  vec3 axis = vec3(0., 0., 1.);
+  base_type cos_theta = -2.;
+  bool empty() const { return cos_theta < -1.5; }
+  static direction_cone all(){ direction_cone c; c.cos_theta = -1.; return c; }
+};
+
+inline direction_cone cone_union(const direction_cone& a, const direction_cone& b){ // smallest cone holding both
+  if(a.empty()) return b;
+  if(b.empty()) return a;
+  const base_type theta_a = std::acos(std::clamp(a.cos_theta, -1., 1.)), theta_b = std::acos(std::clamp(b.cos_theta, -1., 1.));
+  const base_type theta_d = std::acos(std::clamp(dot(a.axis, b.axis), -1., 1.));
+  if(std::min(theta_d + theta_b, pi) <= theta_a) return a;
+  if(std::min(theta_d + theta_a, pi) <= theta_b) return b;
+  const base_type theta_o = (theta_a + theta_d + theta_b) / 2.;
+  if(theta_o >= pi) return direction_cone::all();
+  const vec3 w = cross(a.axis, b.axis); // rotate a's axis toward b's by theta_o - theta_a (Rodrigues)
+  const base_type wl = std::sqrt(dot(w, w));
+  if(wl < 1e-12) return direction_cone::all();
+  const vec3 k = w / wl; const base_type r = theta_o - theta_a;
+  direction_cone c;
+  c.axis = normalize(a.axis * std::cos(r) + cross(k, a.axis) * std::sin(r) + k * (dot(k, a.axis) * (1. - std::cos(r))));
+  c.cos_theta = std::cos(theta_o);
+  return c;
+}
+
+struct light_sample{
+  int primitive = -1;
+  vec3 direction;    // unit, from the shading point toward the light
+  base_type pdf = 0.; // solid angle density, including the chance of picking this light
+};
+
+class light_tree{
+public:
+  void build(const primitive_list& prims, light_mode m){
+    mode = m; emitters.clear(); nodes.clear(); light_of.assign(prims.size(), -1);
+    if(mode == LIGHTS_NONE) return;
+    for(size_t i = 0; i < prims.size(); i++){
+      const primitive_record r = prims[i]->record();
+      if(r.material != 1 || r.type == INSTANCE) continue;
+      emitter e; e.primitive = int(i); e.type = r.type;
+      hitrecord h; h.material_index = 1; h.primitive_index = int(i); h.dtransit = 1.; h.normal = vec3(0., 0., 1.);
+      h.front = true; h.uv = vec2(1./3., 1./3.); const base_type front = luminance(bsdf(h).emitted()); // uv colors average to grey
+      h.front = false;                          const base_type back = luminance(bsdf(h).emitted());
+      if(r.type == TRIANGLE){
+        e.p0 = vec3(r.data[0], r.data[1], r.data[2]);
+        e.e1 = vec3(r.data[3], r.data[4], r.data[5]) - e.p0; e.e2 = vec3(r.data[6], r.data[7], r.data[8]) - e.p0;
+        const vec3 n = cross(e.e1, e.e2); const base_type twice_area = std::sqrt(dot(n, n));
+        if(twice_area <= 0.) continue;
+        e.area = twice_area / 2.; e.power = pi * e.area * (front + back); // both faces emit
+        e.cone = direction_cone::all();
+      } else {
+        e.p0 = vec3(r.data[0], r.data[1], r.data[2]); e.radius = r.data[3];
+        if(e.radius <= 0.) continue;
+        e.area = 4. * pi * e.radius * e.radius; e.power = pi * e.area * front; // only the outside is seen
+        e.cone = direction_cone::all();
+      }
+      if(e.power <= 0.) continue;
+      e.box = prims[i]->bounds();
+      light_of[i] = int(emitters.size());
+      emitters.push_back(e);
+    }
+    if(emitters.empty() || mode != LIGHTS_BVH) return;
+    std::vector<int> order(emitters.size()); std::iota(order.begin(), order.end(), 0);
+    nodes.reserve(2 * emitters.size());
+    split(order, 0, int(order.size()), -1);
+  }
+  bool empty() const { return emitters.empty(); }
+  size_t light_count() const { return emitters.size(); }
+  size_t node_count() const { return nodes.size(); }
+  size_t memory_usage() const { return emitters.size() * sizeof(emitter) + nodes.size() * sizeof(node) + light_of.size() * sizeof(int); }
+  const char* mode_name() const { return LIGHT_MODE_NAMES[mode]; }
+
+  // picks a light for the point x with unit normal n (light behind it is worth nothing), then a direction toward
+  // it - false if there is nothing to pick or the point can't see the picked light
+  bool sample(const vec3& x, const vec3& n, base_type u, base_type u1, base_type u2, light_sample& s) const {
+    if(emitters.empty()) return false;
+    int light; base_type chosen = 1.;
+    if(mode == LIGHTS_UNIFORM){
+      light = std::min(int(u * emitters.size()), int(emitters.size()) - 1);
+      chosen = 1. / emitters.size();
+    } else {
+      int i = 0;
+      while(nodes[i].light < 0){
+        const base_type il = importance(nodes[nodes[i].left], x, n), ir = importance(nodes[nodes[i].right], x, n);
+        if(il + ir <= 0.) return false;
+        const base_type pl = il / (il + ir);
+        if(u < pl){ u = std::min(u / pl, 1. - 1e-12); i = nodes[i].left; chosen *= pl; }
+        else { u = std::min((u - pl) / (1. - pl), 1. - 1e-12); i = nodes[i].right; chosen *= 1. - pl; }
+      }
+      light = nodes[i].light;
+    }
+    const emitter& e = emitters[light];
+    s.primitive = e.primitive;
+    base_type point_pdf;
+    if(e.type == TRIANGLE){ // uniform over the area, converted to solid angle at x
+      const base_type su = std::sqrt(u1), b1 = su * (1. - u2), b2 = su * u2;
+      const vec3 to = e.p0 + e.e1 * b1 + e.e2 * b2 - x;
+      const base_type d2 = dot(to, to);
+      if(d2 <= 0.) return false;
+      s.direction = to / std::sqrt(d2);
+      point_pdf = triangle_pdf(e, s.direction, d2);
+    } else { // uniform over the cone the sphere covers, seen from x
+      const vec3 to = e.p0 - x; const base_type d2 = dot(to, to), r2 = e.radius * e.radius;
+      if(d2 <= r2 * (1. + 1e-9)) return false;
+      const base_type cos_max = std::sqrt(1. - r2 / d2);
+      const base_type cos_t = 1. - u1 * (1. - cos_max), sin_t = std::sqrt(std::max(1. - cos_t*cos_t, 0.)), phi = 2. * pi * u2;
+      const vec3 w = to / std::sqrt(d2); vec3 b1, b2; orthonormal_basis(w, b1, b2);
+      s.direction = normalize(b1 * (sin_t * std::cos(phi)) + b2 * (sin_t * std::sin(phi)) + w * cos_t);
+      point_pdf = 1. / (2. * pi * (1. - cos_max));
+    }
+    s.pdf = chosen * point_pdf;
+    return s.pdf > 0. && std::isfinite(s.pdf);
+  }
+
+  // density sample() would have had for reaching the given primitive along d (unit) at distance t, from x with normal n.
+  // 0 for anything that isn't a sampled light
+  base_type pdf(const vec3& x, const vec3& n, int primitive, const vec3& d, base_type t) const {
+    if(primitive < 0 || size_t(primitive) >= light_of.size() || light_of[primitive] < 0) return 0.;
+    const int light = light_of[primitive];
+    const emitter& e = emitters[light];
+    base_type chosen = 1.;
+    if(mode == LIGHTS_UNIFORM) chosen = 1. / emitters.size();
+    else for(int i = e.leaf; nodes[i].parent >= 0; i = nodes[i].parent){ // the picks that led here, from the leaf up
+      const node& p = nodes[nodes[i].parent];
+      const base_type il = importance(nodes[p.left], x, n), ir = importance(nodes[p.right], x, n);
+      if(il + ir <= 0.) return 0.;
+      chosen *= (i == p.left ? il : ir) / (il + ir);
+    }
+    if(e.type == TRIANGLE) return chosen * triangle_pdf(e, d, t*t);
+    const vec3 to = e.p0 - x; const base_type d2 = dot(to, to), r2 = e.radius * e.radius;
+    if(d2 <= r2 * (1. + 1e-9)) return 0.;
+    return chosen / (2. * pi * (1. - std::sqrt(1. - r2 / d2)));
+  }
+
+private:
+  struct emitter{
+    int primitive, leaf = -1; uint32_t type;
+    vec3 p0, e1, e2; base_type radius = 0.; // triangle: point and edges - sphere: center in p0, and radius
+    base_type area, power;
+    aabb box; direction_cone cone;
+  };
+  struct node{
+    aabb box; direction_cone cone;
+    base_type power = 0.;
+    int left = -1, right = -1, parent = -1, light = -1; // light >= 0 for a leaf
+  };
+  light_mode mode = LIGHTS_NONE;
+  std::vector<emitter> emitters;
+  std::vector<node> nodes; // root first
+  std::vector<int> light_of; // primitive index -> emitter index, -1 for everything else
+
+  static base_type triangle_pdf(const emitter& e, const vec3& d, base_type d2){
+    const vec3 n = cross(e.e1, e.e2);
+    const base_type cos_l = std::abs(dot(n, d)) / std::sqrt(dot(n, n));
+    return cos_l > 1e-12 ? d2 / (e.area * cos_l) : 0.;
+  }
+  // the most light a node could send toward x - power over squared distance, times the best emission and receiving
+  // angles any point in its box could have (Conty Estevez & Kulla 2018). emission cones have a falloff of pi/2
+  static base_type importance(const node& nd, const vec3& x, const vec3& n){
+    const vec3 c = nd.box.centroid(), half = (nd.box.hi - nd.box.lo) * 0.5;
+    const base_type r2 = dot(half, half);
+    const vec3 to = x - c; const base_type d2 = std::max(dot(to, to), r2);
+    const base_type dl = std::sqrt(dot(to, to));
+    const vec3 w = dl > 0. ? to / dl : -1. * n; // from the box toward x
+    // angle the box covers from x - all of them from inside it
+    const base_type cos_b = dot(to, to) < r2 ? -1. : std::sqrt(std::max(1. - r2 / dot(to, to), 0.));
+    auto cos_sub = [](base_type cos_a, base_type cos_c){ // cos(max(0, a - c)) for angles given by their cosines
+      if(cos_a >= cos_c) return 1.;
+      const base_type sin_a = std::sqrt(std::max(1. - cos_a*cos_a, 0.)), sin_c = std::sqrt(std::max(1. - cos_c*cos_c, 0.));
+      return cos_a * cos_c + sin_a * sin_c;
+    };
+    // emission: angle from the cone's axis to x, less the cone and the box's spread
+    const base_type cos_w = dot(nd.cone.axis, w);
+    base_type cos_e = cos_sub(cos_w, nd.cone.cos_theta);
+    cos_e = cos_sub(cos_e, cos_b);
+    if(cos_e <= 0.) return 0.; // falloff pi/2 - nothing leaves past the cone's edge by more than that
+    // receiving: angle between n and the direction to the box, less the box's spread
+    const base_type cos_i = cos_sub(dot(n, -1. * w), cos_b);
+    if(cos_i <= 0.) return 0.;
+    return nd.power * cos_e * cos_i / d2;
+  }
+  // surface area times orientation measure of a cone with pi/2 falloff - what a split tries to keep small, per unit power
+  static base_type orientation_measure(const direction_cone& c){
+    const base_type theta_o = std::acos(std::clamp(c.cos_theta, -1., 1.)), theta_w = std::min(theta_o + pi/2., pi);
+    return 2.*pi*(1. - std::cos(theta_o)) + pi/2. * (2.*theta_w*std::sin(theta_o) - std::cos(theta_o - 2.*theta_w) - 2.*theta_o*std::sin(theta_o) + std::cos(theta_o));
+  }
+  int split(std::vector<int>& order, int begin, int end, int parent){ // builds the subtree over order[begin, end), returns its node
+    const int index = int(nodes.size()); nodes.emplace_back(); nodes[index].parent = parent;
+    node nd; nd.parent = parent;
+    aabb centroids;
+    for(int i = begin; i < end; i++){
+      const emitter& e = emitters[order[i]];
+      nd.box.grow(e.box); nd.power += e.power; nd.cone = cone_union(nd.cone, e.cone); centroids.grow(e.box.centroid());
+    }
+    if(end - begin == 1){
+      nd.light = order[begin]; emitters[nd.light].leaf = index;
+      nodes[index] = nd;
+      return index;
+    }
+    // binned split on the widest centroid axis, by power * area * orientation measure on each side
+    const vec3 extent = centroids.hi - centroids.lo;
+    const int axis = (extent.values[0] > extent.values[1] && extent.values[0] > extent.values[2]) ? 0 : (extent.values[1] > extent.values[2] ? 1 : 2);
+    int mid = (begin + end) / 2;
+    if(extent.values[axis] > 0.){
+      auto bin_of = [&](int light){
+        const base_type t = (emitters[light].box.centroid().values[axis] - centroids.lo.values[axis]) / extent.values[axis];
+        return std::min(int(t * LIGHT_BINS), LIGHT_BINS - 1);
+      };
+      aabb box[LIGHT_BINS]; direction_cone cone[LIGHT_BINS]; base_type power[LIGHT_BINS] = {}; int count[LIGHT_BINS] = {};
+      for(int i = begin; i < end; i++){
+        const int b = bin_of(order[i]); const emitter& e = emitters[order[i]];
+        box[b].grow(e.box); cone[b] = cone_union(cone[b], e.cone); power[b] += e.power; count[b]++;
+      }
+      base_type best = std::numeric_limits<base_type>::max(); int best_bin = -1;
+      for(int s = 1; s < LIGHT_BINS; s++){
+        aabb bl, br; direction_cone cl, cr; base_type pl = 0., pr = 0.; int nl = 0, nr = 0;
+        for(int b = 0; b < s; b++){ bl.grow(box[b]); cl = cone_union(cl, cone[b]); pl += power[b]; nl += count[b]; }
+        for(int b = s; b < LIGHT_BINS; b++){ br.grow(box[b]); cr = cone_union(cr, cone[b]); pr += power[b]; nr += count[b]; }
+        if(!nl || !nr) continue;
+        const base_type cost = pl * bl.surface_area() * orientation_measure(cl) + pr * br.surface_area() * orientation_measure(cr);
+        if(cost < best){ best = cost; best_bin = s; }
+      }
+      if(best_bin > 0)
+        mid = int(std::partition(order.begin() + begin, order.begin() + end, [&](int l){ return bin_of(l) < best_bin; }) - order.begin());
+    }
+    if(mid == begin || mid == end) mid = (begin + end) / 2; // all in one bin
+    nd.left = split(order, begin, mid, index);
+    nd.right = split(order, mid, end, index);
+    nodes[index] = nd;
+    return index;
+  }
+};
+
+#endif
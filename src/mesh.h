@@ -0,0 +1,192 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include <charconv>     // from_chars
+#include <cstring>     // memcmp
+#include <fstream>
+#include <fcntl.h>    // open
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <unistd.h>  // close
+
+#include "pool.h"
+#include "primitives.h"
+
+// mesh loading - wavefront obj, parsed in parallel chunks out of a memory map, and a binary
+// cache format (.amesh) which is just the vertex and index arrays behind a small header
+
+class mapped_file{ // read-only memory map of a whole file, unmapped on destruction
+public:
+  mapped_file(const std::string& path){
+    const int fd = open(path.c_str(), O_RDONLY);
+    if(fd < 0) return;
+    struct stat st;
+    if(fstat(fd, &st) == 0 && st.st_size > 0){
+      void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(p != MAP_FAILED){ base = static_cast<const char*>(p); length = st.st_size; madvise(p, length, MADV_SEQUENTIAL); }
+    }
+    close(fd); // the mapping stays valid without the descriptor
+  }
+  ~mapped_file(){ if(base) munmap(const_cast<char*>(base), length); }
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  bool valid() const { return base != nullptr; }
+  const char* data() const { return base; }
+  size_t size() const { return length; }
+private:
+  const char* base = nullptr;
+  size_t length = 0;
+};
+
+struct mesh_data{ // indexed triangle mesh
+  std::vector<vec3> vertices;
+  std::vector<uint32_t> indices; // three per triangle
+  size_t triangle_count() const { return indices.size() / 3; }
+};
+
+struct amesh_header{ // .amesh layout: header, vertex_count*3 doubles, triangle_count*3 uint32s
+  char magic[8];
+  uint64_t vertex_count;
+  uint64_t triangle_count;
+  uint64_t reserved;
+};
+constexpr char AMESH_MAGIC[8] = {'A','M','M','E','S','H','0','1'};
+
+inline bool obj_space(char c){ return c == ' ' || c == '\t' || c == '\r'; }
+
+// one line-aligned slice of an obj file - counted in the first pass, parsed in the second
+struct obj_chunk{
+  const char *begin, *end;
+  size_t vertex_count = 0, triangle_count = 0; // counts for this chunk
+  size_t vertex_offset = 0, triangle_offset = 0; // prefix sums over the earlier chunks
+};
+
+// walks the v and f lines of a chunk. with out == nullptr it only counts, otherwise it fills the mesh arrays
+inline bool scan_obj_chunk(obj_chunk& chunk, mesh_data* out){
+  size_t v = 0, t = 0;
+  std::vector<long long> refs; // vertex references of the current face
+  for(const char* p = chunk.begin; p < chunk.end; ){
+    const char* eol = static_cast<const char*>(memchr(p, '\n', chunk.end - p));
+    if(!eol) eol = chunk.end;
+    while(p < eol && obj_space(*p)) p++;
+    if(eol - p > 1 && p[0] == 'v' && obj_space(p[1])){ // vertex position
+      if(out){
+        vec3& pos = out->vertices[chunk.vertex_offset + v];
+        p += 2;
+        for(int axis = 0; axis < 3; axis++){
+          while(p < eol && obj_space(*p)) p++;
+          auto [next, error] = std::from_chars(p, eol, pos.values[axis]);
+          if(error != std::errc()) return false;
+          p = next;
+        }
+      }
+      v++;
+    } else if(eol - p > 1 && p[0] == 'f' && obj_space(p[1])){ // face, fan triangulated
+      refs.clear(); p += 2;
+      while(true){
+        while(p < eol && obj_space(*p)) p++;
+        if(p >= eol) break;
+        long long index;
+        auto [next, error] = std::from_chars(p, eol, index);
+        if(error != std::errc() || index == 0) return false;
+        refs.push_back(index > 0 ? index - 1 : static_cast<long long>(chunk.vertex_offset + v) + index); // negative is relative
+        p = next;
+        while(p < eol && !obj_space(*p)) p++; // skip /texcoord/normal
+      }
+      if(refs.size() < 3) return false;
+      if(out)
+        for(size_t i = 2; i < refs.size(); i++){
+          uint32_t* tri = &out->indices[3*(chunk.triangle_offset + t + i - 2)];
+          tri[0] = uint32_t(refs[0]); tri[1] = uint32_t(refs[i-1]); tri[2] = uint32_t(refs[i]);
+          if(refs[0] < 0 || refs[i-1] < 0 || refs[i] < 0) return false;
+        }
+      t += refs.size() - 2;
+    }
+    p = eol + 1;
+  }
+  chunk.vertex_count = v; chunk.triangle_count = t;
+  return true;
+}
+
+inline bool load_obj(const std::string& path, mesh_data& mesh, worker_pool& pool){
+  mapped_file f(path);
+  if(!f.valid()){ cerr << "can't map \'" << path << "\'" << endl; return false; }
+
+  // cut the file into line aligned chunks, a few per worker so uneven chunks balance out
+  const size_t target = std::max<size_t>(1, std::min<size_t>(pool.size() * 4, f.size() / 65536 + 1));
+  std::vector<obj_chunk> chunks;
+  const char* start = f.data(); const char* file_end = f.data() + f.size();
+  for(size_t i = 1; i <= target && start < file_end; i++){
+    const char* end = (i == target) ? file_end : f.data() + f.size() * i / target;
+    if(end < start) end = start;
+    const char* newline = static_cast<const char*>(memchr(end, '\n', file_end - end));
+    end = (newline && i != target) ? newline + 1 : file_end;
+    chunks.push_back(obj_chunk{start, end});
+    start = end;
+  }
+
+  std::atomic<bool> ok{true};
+  pool.parallel_for(chunks.size(), [&](size_t b, size_t e, int){ // first pass - counts
+    for(size_t i = b; i < e; i++) if(!scan_obj_chunk(chunks[i], nullptr)) ok = false;
+  });
+  size_t vertices = 0, triangles = 0;
+  for(auto& c : chunks){
+    c.vertex_offset = vertices; c.triangle_offset = triangles;
+    vertices += c.vertex_count; triangles += c.triangle_count;
+  }
+  if(ok && vertices >= (1ull << 32)){ cerr << "too many vertices in \'" << path << "\'" << endl; return false; } // indices are 32 bit
+  if(ok){
+    mesh.vertices.resize(vertices); mesh.indices.resize(3*triangles);
+    pool.parallel_for(chunks.size(), [&](size_t b, size_t e, int){ // second pass - parse into place
+      for(size_t i = b; i < e; i++) if(!scan_obj_chunk(chunks[i], &mesh)) ok = false;
+    });
+    pool.parallel_for(mesh.indices.size(), [&](size_t b, size_t e, int){
+      for(size_t i = b; i < e; i++) if(mesh.indices[i] >= vertices) ok = false;
+    }, 4096);
+  }
+  if(!ok){ cerr << "malformed obj \'" << path << "\'" << endl; return false; }
+  return true;
+}
+
+inline bool save_amesh(const std::string& path, const mesh_data& mesh){
+  std::ofstream f(path, std::ios::binary);
+  amesh_header h{};
+  std::memcpy(h.magic, AMESH_MAGIC, 8);
+  h.vertex_count = mesh.vertices.size(); h.triangle_count = mesh.triangle_count();
+  f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  f.write(reinterpret_cast<const char*>(mesh.vertices.data()), mesh.vertices.size() * sizeof(vec3));
+  f.write(reinterpret_cast<const char*>(mesh.indices.data()), mesh.indices.size() * sizeof(uint32_t));
+  return bool(f);
+}
+
+// view of an indexed mesh, either into a mesh_data or straight into a mapped .amesh file
+struct mesh_view{
+  const vec3* vertices = nullptr; size_t vertex_count = 0;
+  const uint32_t* indices = nullptr; size_t triangle_count = 0;
+};
+static_assert(sizeof(vec3) == 3*sizeof(base_type), "amesh vertices are mapped directly as vec3");
+
+inline mesh_view view_of(const mesh_data& m){
+  return mesh_view{ m.vertices.data(), m.vertices.size(), m.indices.data(), m.triangle_count() };
+}
+
+inline bool map_amesh(const mapped_file& f, mesh_view& view){ // no parsing, just pointers into the map
+  if(!f.valid() || f.size() < sizeof(amesh_header)) return false;
+  const amesh_header* h = reinterpret_cast<const amesh_header*>(f.data());
+  if(std::memcmp(h->magic, AMESH_MAGIC, 8) != 0) return false;
+  if(f.size() != sizeof(amesh_header) + h->vertex_count * sizeof(vec3) + h->triangle_count * 3 * sizeof(uint32_t)) return false;
+  view.vertices = reinterpret_cast<const vec3*>(f.data() + sizeof(amesh_header));
+  view.vertex_count = h->vertex_count;
+  view.indices = reinterpret_cast<const uint32_t*>(f.data() + sizeof(amesh_header) + h->vertex_count * sizeof(vec3));
+  view.triangle_count = h->triangle_count;
+  return true;
+}
+
+inline bool newer_than(const std::string& a, const std::string& b){ // file a exists and is at least as new as b
+  struct stat sa, sb;
+  if(stat(a.c_str(), &sa) != 0) return false;
+  if(stat(b.c_str(), &sb) != 0) return true;
+  return sa.st_mtime >= sb.st_mtime;
+}
+
+#endif
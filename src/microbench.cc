@@ -0,0 +1,123 @@
+// microbenchmarks for the low level kernels - each one runs in isolation over a pre-generated batch
+//   usage: render_microbench [--ops n] [--threads 1,2,4] [--only kernel]
+
+#include <thread>
+#include <functional>
+#include <numeric>
+
+// geometry and camera
+#include "scene.h"
+
+constexpr int BATCH_SIZE = 4096; // inputs per batch, small enough to stay in cache
+constexpr unsigned long long MICROBENCH_SEED = 0x5EEDULL;
+
+struct kernel_timing{ double ns_per_op, ops_per_sec; };
+
+using batch_kernel = std::function<base_type(int, long long)>; // (thread id, op count) -> sink value
+
+template <typename K> // wraps a per-op kernel k(thread id, op index) in its own loop, so timing has no per-op indirection
+batch_kernel batch(K k){
+  return [k](int t, long long ops){
+    base_type sink = 0.; // results are summed so the compiler can't drop the work
+    for(long long i = 0; i < ops; i++)
+      sink += k(t, i);
+    return sink;
+  };
+}
+
+// runs the batch on each of n threads at once - ns/op is per thread, ops/sec is the aggregate over threads
+kernel_timing time_kernel(int threads, long long ops, const batch_kernel& f){
+  std::vector<base_type> sinks(threads*8, 0.); // spaced out by a cache line
+  std::vector<std::thread> pool;
+  const auto start = std::chrono::steady_clock::now();
+  for(int t = 0; t < threads; t++)
+    pool.emplace_back([&, t](){ sinks[t*8] = f(t, ops); });
+  for(auto& th : pool) th.join();
+  const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  volatile base_type keep = std::accumulate(sinks.begin(), sinks.end(), 0.); (void)keep;
+  return { 1e9 * seconds / ops, threads * ops / seconds };
+}
+
+int main(int argc, char const *argv[]){
+  long long ops = 2000000;
+  std::vector<int> thread_counts;
+  std::string only;
+  for (int i = 1; i < argc; i++){ // every option takes a value
+    const std::string arg = argv[i];
+    if(i+1 >= argc){ cerr << "missing value for \'" << arg << "\'" << endl; return 2; }
+    try {
+      if(arg == "--ops") ops = std::stoll(argv[++i]);
+      else if(arg == "--only") only = argv[++i];
+      else if(arg == "--threads"){
+        std::stringstream l(argv[++i]); std::string n;
+        while(std::getline(l, n, ',')) thread_counts.push_back(std::stoi(n));
+      }
+      else { cerr << "unknown option \'" << arg << "\'" << endl; return 2; }
+    } catch(const std::exception& e) {
+      cerr << "bad value \'" << argv[i] << "\' for \'" << arg << "\'" << endl; return 2;
+    }
+  }
+  if(thread_counts.empty()) // powers of two up to the core count, plus the renderer's thread count
+    for(int t = 1; t <= std::max<int>(std::thread::hardware_concurrency(), NUM_THREADS); t *= 2)
+      thread_counts.push_back(t);
+
+  // pre-generated inputs, shared read-only by every thread
+  auto gen = std::make_shared<std::mt19937_64>(MICROBENCH_SEED);
+  std::vector<ray> rays(BATCH_SIZE);
+  for(auto& r : rays){ // from a shell around the scene, aimed at points inside the unit cube
+    r.origin = random_unit_vector(gen) * 3.;
+    r.direction = normalize(random_vector(gen) * 2. - r.origin);
+  }
+  std::vector<sphere> spheres; std::vector<triangle> triangles; std::vector<woop_triangle> woop_triangles;
+  for(int i = 0; i < BATCH_SIZE; i++){
+    spheres.emplace_back(random_vector(gen), 0.4*rng(gen), 0);
+    const vec3 p0 = random_vector(gen)*2., p1 = random_vector(gen)*2., p2 = random_vector(gen)*2.;
+    triangles.emplace_back(p0, p1, p2, 3);
+    woop_triangles.emplace_back(p0, p1, p2, 3);
+  }
+  std::vector<triangle4> packets(BATCH_SIZE / TRIANGLE_LANES); // the same triangles, four to a packet
+  for(int i = 0; i < BATCH_SIZE; i++) packets[i / TRIANGLE_LANES].set(i % TRIANGLE_LANES, triangles[i]);
+  std::vector<vec2> pixels(BATCH_SIZE); std::vector<base_type> scalars(BATCH_SIZE); std::vector<vec3> colors(BATCH_SIZE);
+  for(int i = 0; i < BATCH_SIZE; i++){
+    pixels[i] = vec2(rng(gen)*X_IMAGE_DIM, rng(gen)*Y_IMAGE_DIM);
+    scalars[i] = rng(gen) * 100.;
+    colors[i] = vec3(rng(gen), rng(gen), rng(gen)) * 4.;
+  }
+  scene s; s.populate(NUM_PRIMITIVES, MICROBENCH_SEED);
+  scene sb = s; sb.build_accel("bvh");  // same scene, through the bvh
+  scene sg = s; sg.build_accel("grid"); // and through the grid
+  camera c; c.lookat(vec3(1.6, 0.8, 2.1), vec3(0.), vec3(0.,1.,0.));
+  std::vector<std::shared_ptr<std::mt19937_64>> gens; // per thread, for the sampling kernels
+  for(int t = 0; t < *std::max_element(thread_counts.begin(), thread_counts.end()); t++) // counts come in any order
+    gens.push_back(std::make_shared<std::mt19937_64>(MICROBENCH_SEED + t));
+
+  const std::vector<std::pair<std::string, batch_kernel>> kernels = {
+    { "sphere::intersect",   batch([&](int, long long i){ return spheres[i % BATCH_SIZE].intersect(rays[(i / 7) % BATCH_SIZE]).dtransit; }) },
+    { "triangle::intersect", batch([&](int, long long i){ return triangles[i % BATCH_SIZE].intersect(rays[(i / 7) % BATCH_SIZE]).dtransit; }) },
+    { "woop_triangle::intersect", batch([&](int, long long i){ return woop_triangles[i % BATCH_SIZE].intersect(rays[(i / 7) % BATCH_SIZE]).dtransit; }) },
+    { "triangle4::intersect", batch([&](int, long long i){ // four triangles per op
+      base_type t[TRIANGLE_LANES]; packets[i % (BATCH_SIZE / TRIANGLE_LANES)].intersect(rays[(i / 7) % BATCH_SIZE], t);
+      return std::min(std::min(t[0], t[1]), std::min(t[2], t[3])); }) },
+    { "scene::ray_query",    batch([&](int, long long i){ return s.ray_query(rays[i % BATCH_SIZE]).dtransit; }) },
+    { "bvh::intersect",      batch([&](int, long long i){ return sb.ray_query(rays[i % BATCH_SIZE]).dtransit; }) },
+    { "bvh::intersect_any",  batch([&](int, long long i){ return base_type(sb.occluded(rays[i % BATCH_SIZE], DMAX_TRAVEL)); }) },
+    { "grid::intersect",     batch([&](int, long long i){ return sg.ray_query(rays[i % BATCH_SIZE]).dtransit; }) },
+    { "camera::sample",      batch([&](int, long long i){ return c.sample(pixels[i % BATCH_SIZE]).direction.values[0]; }) },
+    { "random_unit_vector",  batch([&](int t, long long){ return random_unit_vector(gens[t]).values[2]; }) },
+    { "palette",             batch([&](int, long long i){ return palette(scalars[i % BATCH_SIZE]).values[1]; }) },
+    { "tonemap_and_gamma",   batch([&](int, long long i){ vec3 v = colors[i % BATCH_SIZE]; tonemap_and_gamma(v); return v.values[0]; }) },
+  };
+
+  cout << std::left << std::setw(26) << "kernel" << std::right << std::setw(9) << "threads" << std::setw(12) << "ns/op" << std::setw(16) << "ops/sec" << endl;
+  for(const auto& [name, f] : kernels){
+    if(!only.empty() && name != only) continue;
+    // the linear scene query is ~NUM_PRIMITIVES*2 intersections, so it gets proportionally fewer ops
+    const long long n = (name == "scene::ray_query") ? std::max(1LL, ops / (2*NUM_PRIMITIVES)) : (name.find("bvh::") == 0 || name.find("grid::") == 0) ? ops / 16 : ops;
+    for(int t : thread_counts){
+      const kernel_timing k = time_kernel(t, n, f);
+      cout << std::left << std::setw(26) << name << std::right << std::setw(9) << t << std::fixed
+           << std::setprecision(2) << std::setw(12) << k.ns_per_op << std::setprecision(0) << std::setw(16) << k.ops_per_sec << std::defaultfloat << endl;
+    }
+  }
+  return 0;
+}
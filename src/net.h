@@ -0,0 +1,69 @@
+#ifndef NET_H
+#define NET_H
+
+#include <string>
+#include <cstring>      // memset
+#include <sys/socket.h> // socket, bind, accept, send, recv
+#include <netinet/in.h> // sockaddr_in
+#include <netinet/tcp.h> // TCP_NODELAY
+#include <arpa/inet.h>  // htons
+#include <netdb.h>      // getaddrinfo
+#include <poll.h>       // poll
+#include <unistd.h>     // close
+
+// blocking tcp helpers for the preview server and distributed rendering - plain sockets, -1 or false on failure
+
+inline int listen_on(const int port, const bool local_only){ // a listening socket, on 127.0.0.1 or every interface
+  const int s = socket(AF_INET, SOCK_STREAM, 0);
+  if(s < 0) return -1;
+  const int yes = 1; setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  sockaddr_in a{}; a.sin_family = AF_INET; a.sin_port = htons(uint16_t(port));
+  a.sin_addr.s_addr = htonl(local_only ? INADDR_LOOPBACK : INADDR_ANY);
+  if(bind(s, (sockaddr*)&a, sizeof(a)) < 0 || listen(s, 16) < 0){ close(s); return -1; }
+  return s;
+}
+inline int accept_within(const int listener, const int ms){ // the next connection, or -1 if none came in ms
+  pollfd p{ listener, POLLIN, 0 };
+  if(poll(&p, 1, ms) <= 0) return -1;
+  return accept(listener, nullptr, nullptr);
+}
+inline int connect_to(const std::string& host, const int port){
+  addrinfo hints; std::memset(&hints, 0, sizeof(hints)); hints.ai_family = AF_INET; hints.ai_socktype = SOCK_STREAM;
+  addrinfo* found = nullptr;
+  if(getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0) return -1;
+  int s = -1;
+  for(addrinfo* a = found; a && s < 0; a = a->ai_next){
+    s = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+    if(s >= 0 && connect(s, a->ai_addr, a->ai_addrlen) < 0){ close(s); s = -1; }
+  }
+  freeaddrinfo(found);
+  return s;
+}
+inline void send_at_once(const int s){ // no waiting to coalesce small writes - for request and reply protocols
+  const int yes = 1; setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+inline void receive_timeout(const int s, const int seconds){ // recv fails after this long without data, 0 waits forever
+  timeval t{ seconds, 0 }; setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t));
+}
+inline bool send_all(const int s, const void* data, size_t n){
+  const char* p = static_cast<const char*>(data);
+  while(n){
+    const ssize_t sent = send(s, p, n, MSG_NOSIGNAL); // a closed peer is an error here, not a SIGPIPE
+    if(sent <= 0) return false;
+    p += sent; n -= sent;
+  }
+  return true;
+}
+inline bool recv_all(const int s, void* data, size_t n){ // false on close, error or timeout
+  char* p = static_cast<char*>(data);
+  while(n){
+    const ssize_t got = recv(s, p, n, 0);
+    if(got <= 0) return false;
+    p += got; n -= got;
+  }
+  return true;
+}
+template <typename T> bool send_value(const int s, const T& v){ return send_all(s, &v, sizeof(T)); }
+template <typename T> bool recv_value(const int s, T& v){ return recv_all(s, &v, sizeof(T)); }
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <algorithm>
+
+class worker_pool{ // fixed set of threads, kept alive and reused for every parallel job
+public:
+  worker_pool(int n) : count(std::max(n, 1)) {
+    for(int id = 0; id < count; id++)
+      threads.emplace_back([this, id](){ worker(id); });
+  }
+  ~worker_pool(){
+    { std::lock_guard<std::mutex> lock(m); stopping = true; }
+    wakeup.notify_all();
+    for(auto& t : threads) t.join();
+  }
+  int size() const { return count; }
+
+  void run(const std::function<void(int)>& f){ // runs f(id) once on every worker, returns when all are done
+    std::unique_lock<std::mutex> lock(m);
+    job = &f; remaining = count; generation++;
+    wakeup.notify_all();
+    finished.wait(lock, [this](){ return remaining == 0; });
+    job = nullptr;
+  }
+
+  // splits [0, n) into chunks of at least grain items, handed out dynamically - f(begin, end, worker id)
+  void parallel_for(size_t n, const std::function<void(size_t, size_t, int)>& f, size_t grain = 1){
+    if(n == 0) return;
+    const size_t chunk = std::max(grain, n / (size_t(count) * 8) + 1);
+    std::atomic<size_t> next{0};
+    run([&](int id){
+      for(size_t begin = next.fetch_add(chunk); begin < n; begin = next.fetch_add(chunk))
+        f(begin, std::min(begin + chunk, n), id);
+    });
+  }
+
+private:
+  const int count;
+  std::vector<std::thread> threads;
+  std::mutex m;
+  std::condition_variable wakeup, finished;
+  const std::function<void(int)>* job = nullptr;
+  unsigned long long generation = 0; // bumped per job, so a worker runs each job exactly once
+  int remaining = 0;
+  bool stopping = false;
+
+  void worker(const int id){
+    unsigned long long seen = 0;
+    while(true){
+      const std::function<void(int)>* f;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        wakeup.wait(lock, [&](){ return stopping || generation != seen; });
+        if(stopping) return;
+        seen = generation; f = job;
+      }
+      (*f)(id);
+      std::lock_guard<std::mutex> lock(m);
+      if(--remaining == 0) finished.notify_all();
+    }
+  }
+};
+
+#endif
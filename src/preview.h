@@ -0,0 +1,194 @@
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+#include "core.h"
+#include "net.h"
+#include "stb_image_write.h"
+
+// http preview on localhost - the image so far, and the render's progress, for watching a long or headless render
+// from a browser. workers only mark their finished tiles, one atomic store each. an encoder thread copies the
+// finished tiles into its own frame and compresses that at an interval, and a server thread answers requests from
+// the last encoding, so neither ever waits on a worker or makes one wait:
+//   /        a page that reloads the image and status
+//   /image   the last encoding, jpg or png
+//   /status  json - frame, tiles done, progress, timings
+
+class preview_server{
+public:
+  ~preview_server(){ stop(); }
+  // listens on 127.0.0.1:port - false, with the reason on cerr, if it can't
+  bool start(int port, int interval_ms, const std::string& image_format){
+    if(image_format != "jpg" && image_format != "png"){ cerr << "unknown preview format '" << image_format << "'" << endl; return false; }
+    format = image_format; interval = std::max(interval_ms, 10);
+    listener = listen_on(port, true);
+    if(listener < 0){ cerr << "preview: can't listen on port " << port << endl; return false; }
+    running = true;
+    encoder = std::thread([this](){ encode_loop(); });
+    server = std::thread([this](){ serve_loop(); });
+    cout << "Preview at http://127.0.0.1:" << port << "/" << endl;
+    return true;
+  }
+  void stop(){
+    if(!running) return;
+    { std::lock_guard<std::mutex> lock(wake_mutex); running = false; }
+    wakeup.notify_all();
+    encoder.join(); server.join();
+    close(listener); listener = -1;
+  }
+  bool active() const { return running; }
+
+  // a render writing image, with tiles_to_render of its tiles to do - the preview keeps the last image's pixels until
+  // they are redone
+  void begin_frame(const std::string& name, const unsigned char* image, int w, int h, int tile_size, int tiles_x,
+                   size_t tile_count, size_t tiles_to_render, int spp){
+    std::lock_guard<std::mutex> lock(frame_mutex);
+    source = image; xdim = w; ydim = h; tile = tile_size; nx = tiles_x;
+    done.reset(new std::atomic<unsigned char>[tile_count]); tiles = tile_count;
+    for(size_t i = 0; i < tile_count; i++) done[i].store(0, std::memory_order_relaxed);
+    copied.assign(tile_count, 0);
+    finished = 0; rendering = true;
+    std::lock_guard<std::mutex> s(status_mutex);
+    shown = frame_info{ name, w, h, spp, tiles_to_render }; started = std::chrono::steady_clock::now();
+  }
+  void tile_done(size_t index){ // from a worker, after it wrote the tile's pixels
+    done[index].store(1, std::memory_order_release);
+    finished.fetch_add(1, std::memory_order_relaxed);
+  }
+  // hold() keeps the encoder out of the image while it is rewritten outside the workers' tiles, e.g. by the denoiser
+  std::unique_lock<std::mutex> hold(){ return std::unique_lock<std::mutex>(frame_mutex); }
+  // the render is over, and image may go away - takes its last tiles, or all of them if rewritten, then lets go of it
+  void end_frame(const bool rewritten){
+    {
+      std::lock_guard<std::mutex> lock(frame_mutex);
+      if(rewritten) std::fill(copied.begin(), copied.end(), 0);
+      take_tiles(rewritten);
+      source = nullptr; rendering = false; frames++;
+    }
+    { std::lock_guard<std::mutex> lock(status_mutex); ended = std::chrono::steady_clock::now(); }
+    { std::lock_guard<std::mutex> lock(wake_mutex); poked = true; }
+    wakeup.notify_all();
+  }
+
+private:
+  struct frame_info{ std::string name; int xdim = 0, ydim = 0, spp = 0; size_t tiles = 0; };
+  int listener = -1;
+  std::atomic<bool> running{false};
+  std::thread encoder, server;
+  std::mutex wake_mutex; std::condition_variable wakeup; bool poked = false; // the encoder's interval, cut short by end_frame and stop
+  std::string format = "jpg"; int interval = 1000;
+
+  std::mutex frame_mutex; // the source image and tile flags, and the encoder's copy - never taken by a worker
+  const unsigned char* source = nullptr;
+  int xdim = 0, ydim = 0, tile = 1, nx = 1;
+  std::unique_ptr<std::atomic<unsigned char>[]> done; size_t tiles = 0; // per tile, set by the worker that rendered it
+  std::vector<unsigned char> copied; // per tile, already in frame
+  std::vector<unsigned char> frame;  // the encoder's copy of the image
+  bool changed = false;              // frame differs from the last encoding
+  std::atomic<size_t> finished{0};
+  std::atomic<bool> rendering{false}; std::atomic<unsigned long long> frames{0};
+
+  std::mutex status_mutex; // what the server reads
+  std::shared_ptr<const std::string> encoded; // the last image
+  frame_info shown;
+  std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now(), ended = started;
+  unsigned long long encodes = 0; double encode_seconds = 0.;
+
+  void take_tiles(const bool all){ // newly finished tiles into frame - with frame_mutex held
+    if(!source) return;
+    if(frame.size() != size_t(xdim) * ydim * 4) frame.assign(size_t(xdim) * ydim * 4, 0);
+    for(size_t i = 0; i < tiles; i++){
+      if(copied[i] || !(all || done[i].load(std::memory_order_acquire))) continue;
+      const int x0 = int(i % nx) * tile, y0 = int(i / nx) * tile;
+      const int w = std::min(tile, xdim - x0);
+      for(int y = y0; y < std::min(y0 + tile, ydim); y++)
+        std::copy(source + (size_t(y) * xdim + x0) * 4, source + (size_t(y) * xdim + x0 + w) * 4, frame.begin() + (size_t(y) * xdim + x0) * 4);
+      copied[i] = 1; changed = true;
+    }
+  }
+  void encode_loop(){
+    while(running){
+      {
+        std::lock_guard<std::mutex> lock(frame_mutex);
+        take_tiles(false);
+        if(changed) encode();
+      }
+      std::unique_lock<std::mutex> lock(wake_mutex);
+      wakeup.wait_for(lock, std::chrono::milliseconds(interval), [this](){ return !running || poked; });
+      poked = false;
+    }
+  }
+  void encode(){ // with frame_mutex held
+    const auto t = std::chrono::steady_clock::now();
+    auto out = std::make_shared<std::string>();
+    auto append = [](void* context, void* data, int size){ static_cast<std::string*>(context)->append(static_cast<char*>(data), size); };
+    if(format == "png") stbi_write_png_to_func(append, out.get(), xdim, ydim, 4, frame.data(), xdim * 4);
+    else                stbi_write_jpg_to_func(append, out.get(), xdim, ydim, 4, frame.data(), 85);
+    changed = false;
+    std::lock_guard<std::mutex> lock(status_mutex);
+    encoded = out; encodes++;
+    encode_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t).count();
+  }
+  std::string status() const { // with status_mutex held
+    const double elapsed = std::chrono::duration<double>((rendering ? std::chrono::steady_clock::now() : ended) - started).count();
+    const size_t k = finished;
+    const double progress = rendering ? double(k) / std::max(shown.tiles, size_t(1)) : 1.;
+    std::stringstream j;
+    j << "{\"frame\":\"" << shown.name << "\",\"state\":\"" << (rendering ? "rendering" : frames ? "done" : "idle") << "\""
+      << ",\"frames_done\":" << frames << ",\"resolution\":[" << shown.xdim << "," << shown.ydim << "],\"spp\":" << shown.spp
+      << ",\"tiles\":{\"done\":" << k << ",\"total\":" << shown.tiles << "},\"progress\":" << progress
+      << ",\"elapsed\":" << elapsed << ",\"eta\":" << (progress > 0. && progress < 1. ? elapsed * (1. - progress) / progress : 0.)
+      << ",\"preview\":{\"format\":\"" << format << "\",\"encodes\":" << encodes << ",\"bytes\":" << (encoded ? encoded->size() : 0)
+      << ",\"encode_seconds\":" << encode_seconds << "}}";
+    return j.str();
+  }
+  void serve_loop(){
+    while(running){
+      const int client = accept_within(listener, 100); // wakes up to notice stop
+      if(client < 0) continue;
+      receive_timeout(client, 1); // a stalled client can't hold the server
+      respond(client);
+      close(client);
+    }
+  }
+  void respond(const int client){
+    std::string request; char buffer[1024];
+    while(request.find("\r\n\r\n") == std::string::npos && request.size() < 8192){
+      const ssize_t n = recv(client, buffer, sizeof(buffer), 0);
+      if(n <= 0) break;
+      request.append(buffer, n);
+    }
+    std::stringstream line(request); std::string method, path; line >> method >> path;
+    path = path.substr(0, path.find('?')); // the page adds one so browsers don't reuse the image
+    std::shared_ptr<const std::string> body; std::string type = "text/plain", code = "200 OK";
+    if(method != "GET"){ code = "405 Method Not Allowed"; body = std::make_shared<std::string>("only GET\n"); }
+    else if(path == "/status"){ std::lock_guard<std::mutex> lock(status_mutex); body = std::make_shared<std::string>(status() + "\n"); type = "application/json"; }
+    else if(path == "/image"){
+      { std::lock_guard<std::mutex> lock(status_mutex); body = encoded; }
+      if(body) type = format == "png" ? "image/png" : "image/jpeg";
+      else { code = "503 Service Unavailable"; body = std::make_shared<std::string>("no image yet\n"); }
+    }
+    else if(path == "/"){ body = std::make_shared<std::string>(page()); type = "text/html"; }
+    else { code = "404 Not Found"; body = std::make_shared<std::string>("not found\n"); }
+    std::stringstream h;
+    h << "HTTP/1.1 " << code << "\r\nContent-Type: " << type << "\r\nContent-Length: " << body->size()
+      << "\r\nCache-Control: no-store\r\nConnection: close\r\n\r\n";
+    const std::string head = h.str();
+    if(send_all(client, head.data(), head.size())) send_all(client, body->data(), body->size());
+  }
+  std::string page() const {
+    std::stringstream p;
+    p << "<!doctype html><title>render preview</title><body style=\"background:#222;color:#ddd;font-family:monospace\">"
+      << "<img id=i src=\"/image\" style=\"image-rendering:pixelated;max-width:100%\"><pre id=s></pre><script>"
+      << "setInterval(function(){document.getElementById('i').src='/image?'+Date.now();"
+      << "fetch('/status').then(r=>r.text()).then(t=>document.getElementById('s').textContent=t);}," << interval << ");"
+      << "</script></body>\n";
+    return p.str();
+  }
+};
+
+#endif
@@ -0,0 +1,50 @@
+#ifndef PRIMARY_H
+#define PRIMARY_H
+
+#include "scene.h"
+
+// primary hit cache - for renders that repeat the same camera over the same geometry, and only change what
+// happens after the first hit (materials, lights, roulette, guiding). each pixel sample keeps where its camera
+// ray went through the pixel and which primitive it hit, and a replay intersects just that primitive instead of
+// traversing the structure. that gives back the same distance, uv and normal as the full query. the cache is
+// dropped as soon as the camera, the resolution, the sample count or the scene's geometry version differ
+
+struct primary_view{ // everything a cached first hit depends on
+  camera view;
+  const accelerator* accel = nullptr;
+  unsigned long long geometry = 0; size_t primitives = 0;
+  int xdim = 0, ydim = 0, nsamples = 0;
+  bool operator==(const primary_view& o) const {
+    return view == o.view && accel == o.accel && geometry == o.geometry && primitives == o.primitives
+        && xdim == o.xdim && ydim == o.ydim && nsamples == o.nsamples;
+  }
+};
+
+class primary_cache{
+public:
+  struct entry{ vec2 position; int32_t primitive; }; // image plane sample, contents index - -1 for a miss
+
+  // starts a render - true if the cache holds this view's hits and can be replayed, otherwise it is cleared and
+  // refilled by this render. at most budget bytes, as the first samples of every pixel
+  bool begin(const primary_view& v, size_t budget){
+    const size_t pixels = size_t(v.xdim) * v.ydim;
+    const int fit = pixels ? int(std::min<size_t>(v.nsamples, budget / (pixels * sizeof(entry)))) : 0;
+    if(filled && v == key && fit == per_pixel) return per_pixel > 0;
+    key = v; per_pixel = fit; filled = false;
+    entries.assign(pixels * per_pixel, entry{ vec2(0.), -1 });
+    return false;
+  }
+  void finish(){ filled = per_pixel > 0; } // after a complete render - every cached sample has been written
+  void invalidate(){ filled = false; }
+  bool holds(int sample) const { return sample < per_pixel; }
+  entry& at(int x, int y, int sample){ return entries[(size_t(y) * key.xdim + x) * per_pixel + sample]; }
+  int samples_per_pixel() const { return per_pixel; }
+  size_t memory_usage() const { return entries.size() * sizeof(entry); }
+private:
+  primary_view key;
+  std::vector<entry> entries;
+  int per_pixel = 0;
+  bool filled = false;
+};
+
+#endif
@@ -0,0 +1,211 @@
+#ifndef PRIMITIVES_H
+#define PRIMITIVES_H
+
+#include "core.h"
+
+struct aabb{ // axis aligned bounding box, empty until grown
+  vec3 lo = vec3(DMAX_TRAVEL), hi = vec3(-DMAX_TRAVEL);
+  void grow(const vec3& p){
+    for(int a = 0; a < 3; a++){ lo.values[a] = std::min(lo.values[a], p.values[a]); hi.values[a] = std::max(hi.values[a], p.values[a]); }
+  }
+  void grow(const aabb& b){ if(!b.empty()){ grow(b.lo); grow(b.hi); } }
+  bool empty() const { return lo.values[0] > hi.values[0]; }
+  vec3 centroid() const { return (lo + hi) * 0.5; }
+  base_type surface_area() const {
+    if(empty()) return 0.;
+    const vec3 d = hi - lo;
+    return 2. * (d.values[0]*d.values[1] + d.values[1]*d.values[2] + d.values[2]*d.values[0]);
+  }
+  // slab test, inv is the componentwise reciprocal of the ray direction - entry distance, or DMAX_TRAVEL on a miss
+  base_type hit(const vec3& origin, const vec3& inv, const base_type tmax) const {
+    base_type tnear = 0., tfar = tmax;
+    for(int a = 0; a < 3; a++){
+      const base_type t0 = (lo.values[a] - origin.values[a]) * inv.values[a];
+      const base_type t1 = (hi.values[a] - origin.values[a]) * inv.values[a];
+      tnear = std::max(tnear, std::min(t0, t1));
+      tfar = std::min(tfar, std::max(t0, t1));
+    }
+    return tnear <= tfar ? tnear : DMAX_TRAVEL;
+  }
+};
+
+enum primitive_type : uint32_t { SPHERE = 0, TRIANGLE = 1, INSTANCE = 2 };
+struct primitive_record{ // flat copy of a primitive's geometry, for hashing and serialization
+  uint32_t type;
+  int32_t material;
+  uint64_t object;    // instance: content hash of the instanced object, 0 otherwise
+  base_type data[12]; // sphere: center, radius - triangle: three points - instance: 3x4 transform
+};
+
+class primitive { // base class for primitives
+public:
+  virtual hitrecord intersect(ray r) const = 0; // pure virtual, base definition dne
+  virtual aabb bounds() const = 0;
+  virtual primitive_record record() const = 0;
+  virtual void update(const primitive_record& r) = 0; // new geometry from a record of the same type - material stays
+  int material_index; // indexes into scene material list
+};
+// sphere
+class sphere : public primitive {
+public:
+  sphere(vec3 c, base_type r, int m) : center(c), radius(r) {material_index = m;}
+  hitrecord intersect(ray r) const override {
+    hitrecord h; h.dtransit = DMAX_TRAVEL;
+    vec3 disp = r.origin - center;
+    base_type a = dot(r.direction, r.direction); // reflected rays aren't unit length, keep d a distance along the ray
+    base_type b = dot(r.direction, disp) / a;
+    base_type c = (dot(disp, disp) - radius*radius) / a;
+    base_type des = b * b - c; // b squared minus c - discriminant of the quadratic
+    if(des >= 0){ // hit at either one or two points
+      base_type d = std::min(std::max(-b+std::sqrt(des), 0.), std::max(-b-std::sqrt(des), 0.));
+      if(d > 0.){ // make sure at least one intersection point is in front of the camera before continuing
+        h.dtransit = d;
+        h.material_index = material_index;
+        h.position = r.origin + h.dtransit * r.direction;
+        h.normal = normalize(h.position - center);
+        h.front = dot(h.normal, r.direction) < 0. ? true : false;
+      }
+    }
+    return h;
+  }
+  aabb bounds() const override { aabb b; b.grow(center - vec3(radius)); b.grow(center + vec3(radius)); return b; }
+  primitive_record record() const override {
+    return primitive_record{ SPHERE, material_index, 0, {center.values[0], center.values[1], center.values[2], radius} };
+  }
+  void update(const primitive_record& r) override { center = vec3(r.data[0], r.data[1], r.data[2]); radius = r.data[3]; }
+private:  // geometry parameters
+  vec3 center;
+  base_type radius;
+};
+// triangle
+class triangle : public primitive {
+public:
+  triangle() {material_index = 0;} // for bulk allocation, filled in afterwards
+  triangle(vec3 p0, vec3 p1, vec3 p2, int m) : v0(p0), edge1(p1 - p0), edge2(p2 - p0) {material_index = m;}
+  hitrecord intersect(ray r) const override { // Möller–Trumbore intersection algorithm, on the edges stored at construction
+    hitrecord hit;  hit.dtransit = DMAX_TRAVEL;
+    const vec3 pvec = cross(r.direction, edge2);
+    const base_type det = dot(edge1, pvec);
+    if (det > -HIT_EPSILON && det < HIT_EPSILON)
+      return hit; // no hit, return
+
+    const base_type invDet = 1.0 / det;
+    const vec3 tvec = r.origin - v0;
+    hit.uv.values[0] = dot(tvec, pvec) * invDet; // u value
+    if (hit.uv.values[0] < 0.0f || hit.uv.values[0] > 1.0f)
+      return hit; // no hit, return
+
+    const vec3 qvec = cross(tvec, edge1);
+    hit.uv.values[1] = dot(r.direction, qvec) * invDet; // v value
+    if (hit.uv.values[1] < 0.0f || hit.uv.values[0] + hit.uv.values[1] > 1.0f)
+      return hit; // no hit, return
+
+    hit.dtransit = dot(edge2, qvec) * invDet; // distance term to hit
+    hit.position = v0 + hit.uv.values[0] * edge1 + hit.uv.values[1] * edge2;
+    hit.normal = cross(edge1, edge2);
+    hit.material_index = material_index;
+    hit.front = dot(hit.normal, r.direction) < 0. ? true : false; // determine front or back
+
+    return hit; // return true result with all relevant info
+  }
+  aabb bounds() const override { aabb b; b.grow(v0); b.grow(v0 + edge1); b.grow(v0 + edge2); return b; }
+  primitive_record record() const override {
+    primitive_record r{ TRIANGLE, material_index, 0, {} };
+    const vec3 points[3] = {v0, v0 + edge1, v0 + edge2};
+    for(int i = 0; i < 3; i++) for(int a = 0; a < 3; a++) r.data[3*i+a] = points[i].values[a];
+    return r;
+  }
+  void update(const primitive_record& r) override {
+    v0 = vec3(r.data[0], r.data[1], r.data[2]);
+    edge1 = vec3(r.data[3], r.data[4], r.data[5]) - v0; edge2 = vec3(r.data[6], r.data[7], r.data[8]) - v0;
+  }
+  const vec3& vertex() const { return v0; }
+  const vec3& edge(int i) const { return i ? edge2 : edge1; }
+private:  // geometry parameters - the first point and the edges from it, which is what intersect uses
+  vec3 v0, edge1, edge2;
+};
+
+// triangle as the affine transform taking it to the unit triangle (Baldwin & Weber 2016) - the ray is carried
+// into that space with three dot products per row, then the test is a plane crossing and two compares.
+// more storage than triangle, fewer operations per test
+class woop_triangle : public primitive {
+public:
+  woop_triangle() {material_index = 0;}
+  woop_triangle(vec3 p0, vec3 p1, vec3 p2, int m) : points{p0, p1, p2} {material_index = m; precompute();}
+  hitrecord intersect(ray r) const override {
+    hitrecord hit; hit.dtransit = DMAX_TRAVEL;
+    const base_type oz = m[2][0]*r.origin.values[0] + m[2][1]*r.origin.values[1] + m[2][2]*r.origin.values[2] + m[2][3];
+    const base_type dz = m[2][0]*r.direction.values[0] + m[2][1]*r.direction.values[1] + m[2][2]*r.direction.values[2];
+    const base_type t = -oz / dz; // where the ray crosses the triangle's plane
+    if(!(std::abs(t) < DMAX_TRAVEL)) return hit; // parallel, or degenerate
+    const vec3 p = r.origin + t * r.direction;
+    const base_type u = m[0][0]*p.values[0] + m[0][1]*p.values[1] + m[0][2]*p.values[2] + m[0][3];
+    const base_type v = m[1][0]*p.values[0] + m[1][1]*p.values[1] + m[1][2]*p.values[2] + m[1][3];
+    if(u < 0. || v < 0. || u + v > 1.) return hit;
+    hit.dtransit = t;
+    hit.uv = vec2(u, v);
+    hit.position = p;
+    hit.normal = normal;
+    hit.material_index = material_index;
+    hit.front = dot(hit.normal, r.direction) < 0. ? true : false;
+    return hit;
+  }
+  aabb bounds() const override { aabb b; b.grow(points[0]); b.grow(points[1]); b.grow(points[2]); return b; }
+  primitive_record record() const override {
+    primitive_record r{ TRIANGLE, material_index, 0, {} };
+    for(int i = 0; i < 3; i++) for(int a = 0; a < 3; a++) r.data[3*i+a] = points[i].values[a];
+    return r;
+  }
+  void update(const primitive_record& r) override {
+    for(int i = 0; i < 3; i++) points[i] = vec3(r.data[3*i], r.data[3*i+1], r.data[3*i+2]);
+    precompute();
+  }
+private:
+  vec3 points[3];
+  vec3 normal;
+  base_type m[3][4] = {}; // rows give u, v and the signed plane distance in units of the normal's largest component
+  void precompute(){
+    const vec3 e1 = points[1] - points[0], e2 = points[2] - points[0];
+    normal = cross(e1, e2);
+    const vec3 c1 = cross(points[1], points[0]), c2 = cross(points[2], points[0]);
+    const base_type* n = normal.values;
+    const int k = (std::abs(n[0]) > std::abs(n[1]) && std::abs(n[0]) > std::abs(n[2])) ? 0 : (std::abs(n[1]) > std::abs(n[2]) ? 1 : 2);
+    const int i = (k + 1) % 3, j = (k + 2) % 3; // the other two axes, in cyclic order
+    const base_type inv = 1. / n[k];
+    m[0][i] = e2.values[j] * inv;  m[0][j] = -e2.values[i] * inv; m[0][k] = 0.; m[0][3] = c2.values[k] * inv;
+    m[1][i] = -e1.values[j] * inv; m[1][j] = e1.values[i] * inv;  m[1][k] = 0.; m[1][3] = -c1.values[k] * inv;
+    m[2][i] = n[i] * inv;          m[2][j] = n[j] * inv;          m[2][k] = 1.; m[2][3] = -dot(points[0], normal) * inv;
+  }
+};
+
+// up to four triangles in SoA layout, so a bvh leaf is tested in one pass - the lane loop has no branches and
+// vectorizes. empty lanes hold degenerate triangles, which never hit
+constexpr int TRIANGLE_LANES = 4;
+struct alignas(32) triangle4{
+  base_type v0[3][TRIANGLE_LANES] = {}, e1[3][TRIANGLE_LANES] = {}, e2[3][TRIANGLE_LANES] = {};
+  uint32_t triangles = 0; // bit per lane holding one
+  void set(const int lane, const triangle& t){
+    triangles |= 1u << lane;
+    for(int a = 0; a < 3; a++){ v0[a][lane] = t.vertex().values[a]; e1[a][lane] = t.edge(0).values[a]; e2[a][lane] = t.edge(1).values[a]; }
+  }
+  // distance to each lane's triangle, DMAX_TRAVEL on a miss - the same operations, in the same order, as
+  // triangle::intersect, so the results agree bit for bit
+  void intersect(const ray& r, base_type t[TRIANGLE_LANES]) const {
+    const base_type ox = r.origin.values[0], oy = r.origin.values[1], oz = r.origin.values[2];
+    const base_type dx = r.direction.values[0], dy = r.direction.values[1], dz = r.direction.values[2];
+    for(int l = 0; l < TRIANGLE_LANES; l++){
+      const base_type px = dy * e2[2][l] - dz * e2[1][l], py = -(dx * e2[2][l] - dz * e2[0][l]), pz = dx * e2[1][l] - dy * e2[0][l];
+      const base_type det = e1[0][l]*px + e1[1][l]*py + e1[2][l]*pz;
+      const base_type inv = 1.0 / det;
+      const base_type tx = ox - v0[0][l], ty = oy - v0[1][l], tz = oz - v0[2][l];
+      const base_type u = (tx*px + ty*py + tz*pz) * inv;
+      const base_type qx = ty * e1[2][l] - tz * e1[1][l], qy = -(tx * e1[2][l] - tz * e1[0][l]), qz = tx * e1[1][l] - ty * e1[0][l];
+      const base_type v = (dx*qx + dy*qy + dz*qz) * inv;
+      const base_type d = (e2[0][l]*qx + e2[1][l]*qy + e2[2][l]*qz) * inv;
+      const bool miss = (det > -HIT_EPSILON && det < HIT_EPSILON) | (u < 0.0) | (u > 1.0) | (v < 0.0) | (u + v > 1.0);
+      t[l] = miss ? DMAX_TRAVEL : d;
+    }
+  }
+};
+
+#endif
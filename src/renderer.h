@@ -0,0 +1,565 @@
+#ifndef RENDERER_H
+#define RENDERER_H
+
+#include <fstream>       // report files
+#include <numeric>      // accumulate
+#include <atomic>      // atomic_llong
+#include <thread>     // threads
+#include <condition_variable> // reporter wakeup
+
+#include "config.h"
+#include "instance.h"
+#include "denoise.h"
+#include "bsdf.h"
+#include "termination.h"
+#include "guiding.h"
+#include "primary.h"
+#include "incremental.h"
+#include "preview.h"
+
+// image output - the implementation is compiled in by the including executable
+#include "stb_image_write.h"
+
+class renderer{
+public:
+  std::atomic<unsigned long long> tile_index_counter{0}; // used to get new tiles
+  std::atomic<unsigned long long> tile_finish_counter{0}; // used for status reporting
+  const render_settings settings;
+  const int num_tiles_x, num_tiles_y;
+  const unsigned long long total_tile_count;
+
+  bool scene_ok = true; // false if the scene could not be built, e.g. a mesh failed to load
+
+  renderer(const render_settings& rs = render_settings()) : settings(rs),
+    num_tiles_x(int(std::ceil(float(rs.xdim)/float(rs.tile)))), num_tiles_y(int(std::ceil(float(rs.ydim)/float(rs.tile)))),
+    total_tile_count(num_tiles_x*num_tiles_y), pool(rs.threads), xdim(rs.xdim), ydim(rs.ydim), nsamples(rs.nsamples), bmax(rs.bounces) {
+    dirty.reset(num_tiles_x, num_tiles_y, settings.tile);
+    bytes.resize(xdim*ydim*4, 0); linear.resize(xdim*ydim); stats.resize(settings.threads); paths.resize(settings.threads); guide_paths.resize(settings.threads); tile_seconds.resize(total_tile_count, 0.);
+    phase_timer t; s.populate(settings.primitives, settings.seed, settings.woop);
+    std::shared_ptr<scene> object; // instanced, with its own bvh
+    if(settings.instances){
+      object = std::make_shared<scene>();
+      if(!settings.mesh.empty())
+        scene_ok = object->load_mesh(settings.mesh, settings.mesh_material, settings.mesh_fit, settings.mesh_cache, pool, settings.woop);
+      else
+        object->populate(16, settings.seed, settings.woop);
+    } else if(!settings.mesh.empty())
+      scene_ok = s.load_mesh(settings.mesh, settings.mesh_material, settings.mesh_fit, settings.mesh_cache, pool, settings.woop);
+    rng_seed(); scene_time = t.elapsed();
+    if(settings.random_camera) eye = random_unit_vector(gen[0])*(2.2+rng(gen[0])); // picked once, every render keeps it
+
+    phase_timer a; // acceleration structures, timed on their own
+    accel_config.cache_dir = settings.bvh_cache;
+    accel_config.bvh.split_alpha = settings.split_alpha; accel_config.bvh.split_budget = settings.split_budget;
+    if(!parse_aovs(settings.aov, aov_outputs)) scene_ok = false;
+    if(!parse_rr_policy(settings.rr, termination.policy)){ cerr << "unknown roulette policy '" << settings.rr << "'" << endl; scene_ok = false; }
+    termination.min_depth = settings.rr_min_depth; termination.max_survival = settings.rr_max_survival;
+    if(!parse_builder(settings.bvh_build, accel_config.bvh.builder)){ cerr << "unknown bvh builder \'" << settings.bvh_build << "\'" << endl; scene_ok = false; }
+    if(object){ // instances are placed here, their bounds come from the object's structure
+      if(!object->build_accel(settings.accel, accel_config, &pool)) scene_ok = false;
+      scatter_instances(s, object, settings.instances, settings.seed, settings.bvh_cache);
+    }
+    if(!s.build_accel(settings.accel, accel_config, &pool, settings.validate_accel)) scene_ok = false;
+    if(!s.build_lights(settings.lights)) scene_ok = false;
+    accel_time = a.elapsed();
+    c.resolution(xdim, ydim); c.field_of_view(settings.fov);
+  }
+  void animate_to(const int frame){ // moves the scene to the frame's pose, then refits its structure - or rebuilds it, if refitting has cost too much
+    phase_timer t; s.animate(frame * ANIMATION_STEP); scene_time = t.elapsed();
+    phase_timer a; accel_update = s.refit_accel(settings.refit_threshold, &pool) ? "rebuild" : "refit";
+    s.build_lights(settings.lights); accel_time = a.elapsed(); // the light tree is small next to the bvh, and always rebuilt
+    dirty.mark_all(); view_ready = false;
+  }
+  // incremental editing - changes between renders, each marking the tiles it can show up in (see incremental.h)
+  void move_camera(const vec3& from){ eye = from; } // every tile, once render sees the new view
+  // primitive i's new geometry and material, as a record of its type - false if there is no such primitive
+  bool edit_primitive(const size_t i, const primitive_record& r){
+    if(i >= s.contents.size() || s.contents[i]->record().type != r.type){ cerr << "no primitive " << i << " of that type to edit" << endl; return false; }
+    const bool emitter = s.contents[i]->material_index == 1 || r.material == 1; // lights every tile
+    dirty.mark(s.contents[i]->bounds(), c);
+    phase_timer a;
+    if(s.edit(i, r)) accel_update = s.refit_accel(settings.refit_threshold, &pool) ? "rebuild" : "refit";
+    if(emitter){ s.build_lights(settings.lights); dirty.mark_all(); }
+    accel_time = a.elapsed();
+    dirty.mark(s.contents[i]->bounds(), c);
+    return true;
+  }
+  void invalidate(){ dirty.mark_all(); } // the next render redoes every tile, e.g. for the indirect effects of edits
+  size_t dirty_tiles() const { return dirty.count(); }
+  const std::vector<unsigned long long>& rendered_tiles() const { return tiles; } // by the last render, in index order
+  size_t primitive_count() const { return s.contents.size(); }
+  primitive_record primitive(const size_t i) const { return s.contents[i]->record(); } // to start an edit from
+  void attach_preview(preview_server* p){ preview = p; } // shows each render while it runs, instead of the progress bar
+  bool render_and_save_to(std::string filename){ // false if an output could not be written
+    output_name = filename;
+    render();
+    return save(filename);
+  }
+  void render(){
+    phase_timer render_timer;
+    tile_index_counter = 0; tile_finish_counter = 0; // fresh counters, so a renderer can render more than once
+    std::fill(stats.begin(), stats.end(), render_stats());
+    aim_camera();
+    if(!settings.incremental || !(c == rendered_view)) dirty.mark_all(); // otherwise only the tiles edits have touched
+    tiles.clear();
+    for(unsigned long long index = 0; index < total_tile_count; index++)
+      if(dirty[index]) tiles.push_back(index);
+    const bool full = tiles.size() == total_tile_count; // per image state starts over, rather than keeping the clean tiles'
+    if(full && settings.heatmap){ pixel_rays.assign(xdim*ydim, 0); pixel_bounces.assign(xdim*ydim, 0); }
+    if(full) aovs.reset(xdim*ydim, aov_outputs | (settings.denoise > 0 ? DENOISE_GUIDES : 0u));
+    if(!full && !unfiltered.empty()) linear = unfiltered; // the denoiser filtered the last image in place
+    if(settings.primary_cache > 0){ // replayed if nothing the first hits depend on has changed since the last render
+      primary_view v; v.view = c; v.accel = s.accel.get(); v.geometry = s.version; v.primitives = s.contents.size();
+      v.xdim = xdim; v.ydim = ydim; v.nsamples = nsamples;
+      replay_primaries = primaries.begin(v, size_t(settings.primary_cache) << 20);
+    }
+    if(settings.guide > 0 && full){ // its own phase - the render's timing and counters start after it
+      train_guide();
+      std::fill(stats.begin(), stats.end(), render_stats()); render_timer = phase_timer();
+    }
+    if(preview) preview->begin_frame(output_name, bytes.data(), xdim, ydim, settings.tile, num_tiles_x, total_tile_count, tiles.size(), nsamples);
+    std::thread reporter([this]() { // progress bar, while the pool works through the tiles
+      const auto tstart = std::chrono::high_resolution_clock::now();
+      while(!settings.quiet && !preview){ // report timing
+        // show status - break on 100% completion
+        cout << "\r\033[K";
+        const base_type frac = tiles.empty() ? 1. : base_type(tile_finish_counter)/base_type(tiles.size());
+
+        cout << "["; //  [=====....................] where equals shows progress
+        for(int i = 0; i <= PROGRESS_INDICATOR_STOPS*frac;    i++) cout << "=";
+        for(int i = 0; i < PROGRESS_INDICATOR_STOPS*(1-frac); i++) cout << ".";
+        cout << "]" << std::flush;
+
+        // const int tile_width_char = std::ceil(std::log10(total_tile_count));
+        // cout << " (" << std::setw(tile_width_char) << tile_finish_counter << " / " << std::setw(tile_width_char) << total_tile_count << ") " << std::flush;
+        cout << "[" << std::setw(3) << 100.*frac << "% " << std::flush;
+
+        cout << std::setw(7) << std::showpoint << std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::high_resolution_clock::now()-tstart).count()/1000.
+              << " sec]" << std::flush;
+
+        if(tile_finish_counter >= tiles.size()){
+          const float seconds = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now()-tstart).count()/1000.;
+          cout << "\r\033[K[" << std::string(PROGRESS_INDICATOR_STOPS+1, '=')<<"] "<< seconds << " sec" << endl; break; }
+
+        // sleep for some amount of time before showing again - woken early when the workers finish
+        std::unique_lock<std::mutex> lock(report_mutex);
+        report_wakeup.wait_for(lock, std::chrono::milliseconds(REPORT_DELAY), [this](){ return tile_finish_counter >= tiles.size(); });
+      }
+    });
+    run_tiles();
+    render_time = render_timer.elapsed();
+    if(settings.primary_cache > 0 && (replay_primaries || full)) primaries.finish(); // a partial fill leaves the clean tiles' entries unset
+    dirty.clear(); rendered_view = c;
+    if(settings.incremental && settings.denoise > 0) unfiltered = linear;
+    if(settings.denoise > 0){ // filters the linear image, then tonemaps it over the unfiltered one
+      phase_timer denoise_timer;
+      denoise_settings ds; ds.passes = settings.denoise;
+      ds.sigma_color = settings.denoise_color; ds.sigma_normal = settings.denoise_normal; ds.sigma_depth = settings.denoise_depth;
+      denoise(linear, aovs, xdim, ydim, ds, pool);
+      auto hold = preview ? preview->hold() : std::unique_lock<std::mutex>(); // the preview is copying finished tiles
+      pool.parallel_for(linear.size(), [this](size_t begin, size_t end, int){
+        for(size_t i = begin; i < end; i++){
+          vec3 col = linear[i]; tonemap_and_gamma(col, settings.gamma);
+          write(col, vec2(i % xdim, i / xdim));
+        }
+      }, 1024);
+      denoise_time = denoise_timer.elapsed();
+    }
+    if(preview) preview->end_frame(settings.denoise > 0);
+    { std::lock_guard<std::mutex> lock(report_mutex); } report_wakeup.notify_all();
+    reporter.join();
+    if(!settings.quiet) report();
+  }
+  // just these tiles, into the linear and tonemapped image - for a distributed worker (distributed.h). the first call
+  // after construction or animate_to picks the view and trains the guide as render would, so seeded tiles come out
+  // the same as in a full render
+  void render_tiles(const std::vector<unsigned long long>& list){
+    phase_timer render_timer;
+    if(!view_ready){
+      aim_camera();
+      if(settings.heatmap){ pixel_rays.assign(xdim*ydim, 0); pixel_bounces.assign(xdim*ydim, 0); }
+      if(settings.guide > 0) train_guide();
+      view_ready = true;
+    }
+    std::fill(stats.begin(), stats.end(), render_stats()); // counters for this batch
+    tiles = list; tile_index_counter = 0; tile_finish_counter = 0;
+    run_tiles();
+    render_time = render_timer.elapsed();
+  }
+  bool save(std::string filename){ // the image, then reports, heatmaps and aovs - false if the image or an aov failed
+    cout << "Writing \'" << filename << "\'";
+    phase_timer encode_timer;
+    bool ok = stbi_write_png(filename.c_str(), xdim, ydim, 4, &bytes[0], xdim * 4) != 0;
+    encode_time = encode_timer.elapsed();
+    cout << " - " << encode_time.wall << " seconds" << endl;
+    if(!ok) cerr << "can't write \'" << filename << "\'" << endl;
+    if(!settings.report_path.empty())
+      json_report(filename);
+    if(settings.heatmap)
+      write_heatmaps(filename);
+    if(aov_outputs && !aovs.write(filename.substr(0, filename.rfind(".png")), aov_outputs, xdim, ydim))
+      ok = false;
+    return ok;
+  }
+  render_stats totals() const { // sum of the per thread counters from the last render
+    render_stats total;
+    for(const auto& st : stats) total += st;
+    return total;
+  }
+  const phase_time& scene_build_time() const { return scene_time; }
+  const phase_time& accel_build_time() const { return accel_time; }
+  unsigned long long accel_mismatches() const { // from --validate_accel, 0 without it
+    const auto v = std::dynamic_pointer_cast<const validating_accel>(s.accel);
+    return v ? v->mismatch_count() : 0;
+  }
+  const phase_time& render_phase_time() const { return render_time; }
+  const std::vector<unsigned char>& image() const { return bytes; }
+  const std::vector<vec3>& linear_image() const { return linear; } // before tonemapping, after denoising
+  const aov_buffers& aov() const { return aovs; }
+private:
+  worker_pool pool; // render workers, also used for parallel scene building
+  camera c; // generates view rays
+  scene s; // holds all scene geometry + their associated materials
+  std::vector<render_stats> stats; // per thread counters, summed in report()
+  termination_policy termination;   // russian roulette - when paths stop
+  std::vector<path_statistics> paths; // per thread, what the efficiency policy learns over a tile
+  guide_tree guide;                   // incident light learned by the guiding passes, shared by all threads
+  primary_cache primaries;             // first hits of the last render, kept for the next one
+  bool replay_primaries = false;       // this render replays them, rather than filling the cache
+  vec3 eye = settings.camera_position;  // camera position, a seeded random one unless the settings fix it
+  camera rendered_view;                // the view the image was last rendered from
+  tile_set dirty;                      // tiles that changes since then may have touched
+  std::vector<unsigned long long> tiles; // this render's tile indices, all of them unless incremental
+  std::vector<vec3> unfiltered;        // incremental with the denoiser - the image before filtering, kept for the next render
+  preview_server* preview = nullptr;   // http view of the image so far, owned by the caller
+  std::string output_name;             // file the render is for, as the preview names it
+  bool view_ready = false;             // render_tiles has aimed the camera for this frame
+  std::vector<guide_path> guide_paths; // per thread, the current training path's vertices
+  std::vector<double> tile_seconds; // wall time spent on each tile, by tile index
+  std::vector<unsigned> pixel_rays, pixel_bounces; // per pixel totals over all samples, only kept for heatmaps
+  phase_time scene_time, accel_time, guide_time, render_time, denoise_time, encode_time; // per phase timing for the reports
+  accel_settings accel_config; // bvh builder and cache settings
+  std::string accel_update = "build"; // what the last accel phase did - build, or with animation refit / rebuild
+  std::mutex report_mutex; std::condition_variable report_wakeup; // lets the reporter exit without a full sleep
+  int xdim, ydim, nsamples, bmax;
+  std::vector<unsigned char> bytes;        // image buffer for stb_image_write
+  std::vector<vec3> linear;               // averaged samples before tonemapping, what the denoiser works on
+  aov_buffers aovs;                      // first hit outputs - the ones asked for, plus the denoiser's guides
+  unsigned aov_outputs = 0;             // aov kinds written out with the image
+  static constexpr unsigned DENOISE_GUIDES = (1u << AOV_DEPTH) | (1u << AOV_NORMAL) | (1u << AOV_ALBEDO);
+  std::vector<std::shared_ptr<std::mt19937_64>> gen; // PRNG states per thread
+  void rng_seed(){
+    std::random_device r;
+    for(int i = 0; i < settings.threads; i++){
+      std::seed_seq s = settings.seed ? std::seed_seq{uint32_t(settings.seed), uint32_t(settings.seed >> 32), uint32_t(i)}
+                                      : std::seed_seq{r(), r(), r(), r(), r(), r(), r(), r(), r()};
+      gen.push_back(std::make_shared<std::mt19937_64>(s));
+    }
+  }
+  void report() const { // performance report, from the actual per-thread counters
+    const render_stats total = totals();
+    const double seconds = std::max(render_time.wall, 0.001);
+    const double paths = std::max(total.samples, 1ull);
+    auto percent = [&](unsigned long long n){ return 100. * double(n) / paths; };
+    cout << "  " << xdim << "x" << ydim << " at " << nsamples << " spp, " << settings.threads << " threads, " << s.contents.size() << " primitives" << endl;
+    cout << "  accel " << std::left << std::setw(8) << (accel_update + ":") << std::right << accel_time.wall << " sec ("
+                                 << (s.accel ? s.accel->summary() : "none") << ", " << (s.accel ? s.accel->memory_usage() : 0) / 1048576. << " MB)" << endl;
+    if(!s.lights.empty())
+      cout << "  lights:       " << s.lights.light_count() << " sampled (" << s.lights.mode_name() << ", " << s.lights.node_count() << " nodes)" << endl;
+    cout << "  samples:      " << total.samples << " (" << total.samples/seconds << " samples/sec)" << endl;
+    cout << "  rays:         " << total.total_rays() << " (" << total.total_rays()/seconds << " rays/sec)" << endl;
+    cout << "    camera:     " << total.camera_rays << (total.camera_replays ? " (" + std::to_string(total.camera_replays) + " more replayed from the primary cache)" : "") << endl;
+    cout << "    bounce:     " << total.bounce_rays << endl;
+    cout << "    shadow:     " << total.shadow_rays << endl;
+    cout << "  isect tests:  " << total.intersection_tests << " (" << total.intersection_tests/seconds << " tests/sec)" << endl;
+    cout << "  path length:  " << double(total.camera_rays + total.camera_replays + total.bounce_rays)/paths << " avg (" << termination.name() << " roulette"
+         << (termination.min_depth ? " from bounce " + std::to_string(termination.min_depth) : "") << ")" << endl;
+    cout << "  terminations: " << percent(total.terminated_escape) << "% escape, " << percent(total.terminated_roulette) << "% roulette, "
+                                 << percent(total.terminated_max_bounces) << "% max bounces" << endl;
+    if(settings.guide > 0)
+      cout << "  guiding:      " << guide.iteration_count() << " training passes, " << guide.leaf_count() << " regions, "
+                                 << guide.direction_nodes() << " direction nodes, " << guide_time.wall << " sec" << endl;
+    if(settings.incremental)
+      cout << "  incremental:  " << tiles.size() << " of " << total_tile_count << " tiles rendered" << endl;
+    if(settings.denoise > 0)
+      cout << "  denoise:      " << settings.denoise << " passes, " << denoise_time.wall << " sec" << endl;
+  }
+  void json_report(const std::string& filename) const { // one json object per frame, on a single line
+    const render_stats total = totals();
+    const double seconds = std::max(render_time.wall, 0.001);
+    std::vector<double> sorted; // this render's tiles only - the others keep an earlier render's times
+    for(const unsigned long long index : tiles) sorted.push_back(tile_seconds[index]);
+    std::sort(sorted.begin(), sorted.end());
+    if(sorted.empty()) sorted.push_back(0.); // an incremental render with nothing to redo
+    auto percentile = [&](double p){ return sorted[std::min(sorted.size()-1, size_t(p*sorted.size()))]; };
+    auto phase = [](const phase_time& t){ std::stringstream o; o << "{\"wall\":" << t.wall << ",\"cpu\":" << t.cpu << "}"; return o.str(); };
+
+    std::stringstream j;
+    j << "{\"output\":\"" << filename << "\""
+      << ",\"resolution\":[" << xdim << "," << ydim << "],\"spp\":" << nsamples << ",\"max_bounces\":" << bmax
+      << ",\"threads\":" << settings.threads << ",\"primitives\":" << s.contents.size()
+      << ",\"accel\":{\"backend\":\"" << settings.accel << "\",\"update\":\"" << accel_update << "\",\"bytes\":" << (s.accel ? s.accel->memory_usage() : 0)
+      << (s.accel && !s.accel->json().empty() ? "," + s.accel->json() : "") << "}"
+      << ",\"lights\":{\"mode\":\"" << s.lights.mode_name() << "\",\"count\":" << s.lights.light_count() << ",\"nodes\":" << s.lights.node_count()
+      << ",\"bytes\":" << s.lights.memory_usage() << "}"
+      << ",\"phases\":{\"scene_build\":" << phase(scene_time) << ",\"accel_build\":" << phase(accel_time) << ",\"guide\":" << phase(guide_time) << ",\"render\":" << phase(render_time) << ",\"denoise\":" << phase(denoise_time) << ",\"encode\":" << phase(encode_time) << "}"
+      << ",\"samples\":" << total.samples << ",\"samples_per_sec\":" << total.samples/seconds
+      << ",\"rays\":{\"camera\":" << total.camera_rays << ",\"camera_replayed\":" << total.camera_replays << ",\"bounce\":" << total.bounce_rays << ",\"shadow\":" << total.shadow_rays
+      << ",\"total\":" << total.total_rays() << ",\"per_sec\":" << total.total_rays()/seconds << "}"
+      << ",\"intersection_tests\":" << total.intersection_tests
+      << ",\"terminations\":{\"escape\":" << total.terminated_escape << ",\"roulette\":" << total.terminated_roulette
+      << ",\"max_bounces\":" << total.terminated_max_bounces << ",\"policy\":\"" << termination.name() << "\",\"min_depth\":" << termination.min_depth << "}"
+      << ",\"path_length\":" << double(total.camera_rays + total.camera_replays + total.bounce_rays)/std::max(total.samples, 1ull)
+      << ",\"thread_times\":[";
+    for(size_t i = 0; i < stats.size(); i++)
+      j << (i ? "," : "") << "{\"tiles\":" << stats[i].tiles << ",\"busy\":" << stats[i].busy_seconds
+        << ",\"idle\":" << std::max(0., render_time.wall - stats[i].busy_seconds) << ",\"cpu\":" << stats[i].cpu_seconds << "}";
+    j << "],\"tiles_rendered\":" << tiles.size() << ",\"tile_seconds\":{\"count\":" << tiles.size() << ",\"min\":" << sorted.front() << ",\"p50\":" << percentile(0.5)
+      << ",\"p90\":" << percentile(0.9) << ",\"p99\":" << percentile(0.99) << ",\"max\":" << sorted.back()
+      << ",\"mean\":" << std::accumulate(sorted.begin(), sorted.end(), 0.)/sorted.size() << "}}";
+
+    if(settings.report_path == "-"){
+      cerr << j.str() << endl;
+    } else {
+      std::ofstream f(settings.report_path, std::ios::app);
+      f << j.str() << endl;
+    }
+  }
+  void write_heatmaps(const std::string& filename) const { // <name>_tiles.png, <name>_rays.png, <name>_bounces.png
+    const std::string base = filename.substr(0, filename.rfind(".png"));
+    auto save = [&](const std::string& suffix, auto value){ // value(x,y) -> cost, normalized to the max over the image
+      std::vector<double> v(xdim*ydim); std::vector<unsigned char> out(xdim*ydim*4);
+      for (int y = 0; y < ydim; y++)
+      for (int x = 0; x < xdim; x++)
+        v[y*xdim+x] = value(x,y);
+      const double vmax = std::max(*std::max_element(v.begin(), v.end()), 1e-12);
+      for (size_t i = 0; i < v.size(); i++){
+        const vec3 col = heat_color(v[i]/vmax);
+        for(int c = 0; c < 4; c++)
+          out[4*i+c] = (c == 3) ? 255 : col.values[c] * 255.;
+      }
+      stbi_write_png((base+suffix).c_str(), xdim, ydim, 4, &out[0], xdim * 4);
+      cout << "Heatmap \'" << base+suffix << "\' - max " << vmax << endl;
+    };
+    save("_tiles.png",   [&](int x, int y){ return tile_seconds[(y/settings.tile)*num_tiles_x + x/settings.tile]; }); // seconds per tile
+    save("_rays.png",    [&](int x, int y){ return double(pixel_rays[y*xdim+x])/nsamples; });   // rays per sample
+    save("_bounces.png", [&](int x, int y){ return double(pixel_bounces[y*xdim+x])/nsamples; }); // bounces per sample
+  }
+  void aim_camera(){
+    // c.lookat(vec3(0., 0., 2.), vec3(0.), vec3(0.,1.,0.));
+    c.lookat(eye, vec3(0.), vec3(0.,1.,0.));
+  }
+  void run_tiles(){ // renders the tiles list on the pool
+    // the common tile sizes get a loop with compile time bounds, anything else takes the general one
+    void (renderer::*tile_loop)(unsigned long long, int) = (settings.tile == 8) ? &renderer::render_tile<8>
+      : (settings.tile == 16) ? &renderer::render_tile<16> : (settings.tile == 32) ? &renderer::render_tile<32> : &renderer::render_tile<0>;
+    pool.run([this, tile_loop](int id){ // tile workers
+      const double cpu_start = thread_cpu_seconds();
+      while(true){ // tiles are handed out in order, from a shared counter
+        unsigned long long next = tile_index_counter.fetch_add(1);
+        if(next >= tiles.size()) break;
+        (this->*tile_loop)(tiles[next], id);
+        if(preview) preview->tile_done(tiles[next]);
+        tile_finish_counter.fetch_add(1);
+      }
+      stats[id].cpu_seconds = thread_cpu_seconds() - cpu_start;
+    });
+  }
+  template <int TILE> // TILE > 0 fixes the tile size at compile time, 0 reads it from settings
+  void render_tile(const unsigned long long index, const int id){
+    const int tile_size = TILE ? TILE : settings.tile;
+    const auto tile_start = std::chrono::steady_clock::now();
+    if(settings.seed) // seeded renders restart the stream per tile, so output does not depend on scheduling
+      gen[id]->seed(wang_hash(uint32_t(settings.seed)) ^ (uint64_t(wang_hash(uint32_t(index))) << 32));
+
+    const int tile_x_index = index % num_tiles_x;
+    const int tile_y_index = (index / num_tiles_x);
+
+    const int tile_base_x = tile_x_index*tile_size;
+    const int tile_base_y = tile_y_index*tile_size;
+
+    const int tile_end_x = std::min(tile_base_x+tile_size, xdim); // clip to the image, so that
+    const int tile_end_y = std::min(tile_base_y+tile_size, ydim); // no samples are wasted
+    if(termination.learns()) paths[id].reset(bmax);
+    for (int y = tile_base_y; y < tile_end_y; y++)
+    for (int x = tile_base_x; x < tile_end_x; x++) {
+      const unsigned long long rays_before = stats[id].total_rays(), bounces_before = stats[id].bounce_rays;
+      vec3 running_color = vec3(0.);      // initially zero, averages sample data
+      pixel_estimate px;                 // what roulette knows about the pixel so far
+      if(aovs.active()) aovs.clear(y*xdim+x);
+      for (int s = 0; s < nsamples; s++){ // get sample data (n samples)
+        const vec3 sample = get_pathtrace_color_sample(x,y,s,id,px);
+        running_color += sample;
+        px.add(luminance(sample));
+      }
+      running_color /= base_type(nsamples);  // sample averaging
+      linear[y*xdim+x] = running_color;
+      if(aovs.active()) aovs.average(y*xdim+x, nsamples);
+      tonemap_and_gamma(running_color, settings.gamma); // tonemapping + gamma
+      write(running_color, vec2(x,y));     // write final output values
+      if(settings.heatmap){ // per pixel cost
+        pixel_rays[y*xdim+x] = stats[id].total_rays() - rays_before;
+        pixel_bounces[y*xdim+x] = stats[id].bounce_rays - bounces_before;
+      }
+    }
+
+    tile_seconds[index] = std::chrono::duration<double>(std::chrono::steady_clock::now()-tile_start).count();
+    stats[id].busy_seconds += tile_seconds[index];
+    stats[id].tiles++;
+  }
+  // training samples skip the aovs, and record into the guide's trees
+  vec3 get_pathtrace_color_sample(const int x, const int y, const int sample, const int id, const pixel_estimate& px, const bool training = false){
+    // throughput's initial value of 1. in each channel indicates that it is initially
+    // capable of carrying all of the light intensity possible (100%), and it is reduced
+    vec3 throughput = vec3(1.); // by the albedo of the material on each bounce
+    vec3 current    = vec3(0.); // init to zero - initially no light present
+
+    render_stats& st = stats[id]; st.samples++;
+    path_statistics& ps = paths[id]; const bool learning = termination.learns();
+    if(learning) ps.begin();
+    guide_path& gp = guide_paths[id];
+    if(training) gp.begin();
+
+    // get initial ray origin + ray direction from camera - a replayed sample still makes the two draws, then takes
+    // its cached position. over unchanged materials the paths draw exactly as they did when recorded
+    vec2 position(x+rng(gen[id]),y+rng(gen[id]));
+    primary_cache::entry* cached = !training && primaries.holds(sample) ? &primaries.at(x, y, sample) : nullptr;
+    if(cached && replay_primaries) position = cached->position;
+    ray r = c.sample(position);
+    const bool nee = !s.lights.empty(); // lights are sampled directly, and emission found by bounces is weighed against that
+    base_type last_pdf = 0.; vec3 last_point, last_normal; // the previous vertex, where the bounce ray was sampled - pdf 0 if specular
+    int bounce = 0;
+    for (; bounce < bmax; bounce++){
+      hitrecord h = bounce == 0 && cached ? primary_hit(*cached, position, r, st) : s.ray_query(r, &st); // get a new hit location (scene query)
+      if(bounce > 0) st.bounce_rays++; else if(!(cached && replay_primaries)) st.camera_rays++;
+      if(bounce == 0 && aovs.active() && !training) aovs.add_hit(y*xdim+x, h);
+
+      const bsdf b(h); // the hit material's scattering
+      if(!b.scatters()){
+        // current += throughput * 0.1 * vec3(0.918, 0.75, 0.6); // sky color and escape
+        st.terminated_escape++;
+        break; // escape - leaves the first hit's albedo and throughput aovs at zero
+      }
+
+      // the form is:
+        // current    += throughput*current_emission // emission term
+        // throughput *= bsdf*cos/pdf               // absorption term, the albedo for cosine sampled diffuse
+      base_type emission_weight = 1.; // camera rays and mirror bounces can only find lights this way
+      if(nee && last_pdf > 0. && h.instance_index < 0)
+        emission_weight = power_heuristic(last_pdf, s.lights.pdf(last_point, last_normal, h.primitive_index, r.direction, h.dtransit));
+      current += throughput * b.emitted() * emission_weight;
+      const vec3 point = r.origin + h.dtransit*r.direction;
+      direction_tree* dt = settings.guide > 0 && !b.specular() ? guide.at(point, b.normal()) : nullptr; // the light arriving here, as learned
+      if(nee && !b.specular()) current += throughput * light_sample_color(b, dt, point, id);
+      const bsdf_sample next = scatter_sample(b, dt, r.direction, id);
+      if(training) gp.add(dt, next.direction, luminance(throughput * next.weight), next.pdf, dot(next.direction, b.normal()), luminance(current));
+      r.origin = point + h.normal*HIT_EPSILON;
+      r.direction = next.direction;
+      throughput *= next.weight;
+      last_pdf = next.pdf; last_point = point + b.normal()*SHADOW_EPSILON; last_normal = b.normal();
+      if(bounce == 0 && aovs.active() && !training) aovs.add_shading(y*xdim+x, b.color(), throughput);
+
+      const base_type p = termination.survival(throughput, bounce, px, ps);
+      if(rng(gen[id]) > p){ // russian roulette termination check
+        st.terminated_roulette++;
+        break;
+      }
+      if(learning) ps.survived(bounce, luminance(throughput), p, luminance(current), st.total_rays());
+
+      throughput *= 1./p; // russian roulette compensation term
+
+    }
+    if(bounce == bmax) st.terminated_max_bounces++;
+    if(learning) ps.finish(luminance(current), st.total_rays());
+    if(training) gp.finish(luminance(current));
+    return current;
+  }
+  // path guiding training - settings.guide passes over the image at 1, 2, 4, ... spp, each sampling from the trees the
+  // last one refined and recording into new ones. the samples only teach the trees, the image comes from the pass after
+  void train_guide(){
+    phase_timer t;
+    guide.reset(s.accel ? s.accel->bounds() : aabb());
+    for(int pass = 0; pass < settings.guide; pass++){
+      const int spp = 1 << pass;
+      pool.parallel_for(total_tile_count, [this, spp, pass](size_t begin, size_t end, int id){
+        for(size_t index = begin; index < end; index++){
+          if(settings.seed) // per tile and pass, like render_tile
+            gen[id]->seed(wang_hash(uint32_t(settings.seed) ^ wang_hash(uint32_t(pass + 1))) ^ (uint64_t(wang_hash(uint32_t(index))) << 32));
+          if(termination.learns()) paths[id].reset(bmax);
+          const int x0 = (index % num_tiles_x) * settings.tile, y0 = (index / num_tiles_x) * settings.tile;
+          for(int y = y0; y < std::min(y0 + settings.tile, ydim); y++)
+          for(int x = x0; x < std::min(x0 + settings.tile, xdim); x++){
+            pixel_estimate px;
+            for(int i = 0; i < spp; i++) px.add(luminance(get_pathtrace_color_sample(x, y, i, id, px, true)));
+          }
+        }
+      });
+      guide.refine(spp);
+    }
+    guide_time = t.elapsed();
+  }
+  // density of the bounce direction wi at b - the bsdf's, or its mix with the guide's where one has been learned. the
+  // guide's sphere is folded onto the surface's side, so a sample from behind it isn't wasted: either direction leads to wi
+  base_type scatter_pdf(const bsdf& b, const direction_tree* dt, const vec3& wi) const {
+    if(!dt || !dt->trained() || b.specular()) return b.pdf(wi);
+    const base_type c = dot(wi, b.normal());
+    const base_type guided = c > 0. ? dt->pdf(wi) + dt->pdf(wi - 2.*c*b.normal()) : 0.;
+    return settings.guide_fraction * guided + (1. - settings.guide_fraction) * b.pdf(wi);
+  }
+  bsdf_sample scatter_sample(const bsdf& b, const direction_tree* dt, const vec3& d, const int id){
+    if(!dt || !dt->trained() || b.specular()) return b.sample(d, gen[id]);
+    bsdf_sample next;
+    if(rng(gen[id]) < settings.guide_fraction){
+      const base_type u1 = rng(gen[id]), u2 = rng(gen[id]);
+      next.direction = dt->sample(u1, u2);
+      const base_type c = dot(next.direction, b.normal());
+      if(c < 0.) next.direction = next.direction - 2.*c*b.normal();
+    } else
+      next = b.sample(d, gen[id]);
+    next.pdf = scatter_pdf(b, dt, next.direction);
+    next.weight = next.pdf > 0. ? b.eval(next.direction) / next.pdf : vec3(0.);
+    return next;
+  }
+  // the camera ray's hit through the primary cache - recorded while it fills, afterwards the cached primitive is
+  // intersected alone, which gives the same record the full query found
+  hitrecord primary_hit(primary_cache::entry& e, const vec2& position, const ray& r, render_stats& st) const {
+    if(!replay_primaries){
+      const hitrecord h = s.ray_query(r, &st);
+      e.position = position; e.primitive = h.dtransit < DMAX_TRAVEL ? (h.instance_index < 0 ? h.primitive_index : h.instance_index) : -1;
+      return h;
+    }
+    st.camera_replays++;
+    if(e.primitive < 0) return hitrecord();
+    st.intersection_tests++;
+    hitrecord h = s.contents[e.primitive]->intersect(r);
+    (h.instance_index < 0 ? h.primitive_index : h.instance_index) = e.primitive;
+    return h;
+  }
+  // one light sample from the surface b at point - the light's emission times bsdf and cosine over the pdf, mis
+  // weighted against the bsdf having sampled the same direction. zero if the light faces away or is blocked
+  vec3 light_sample_color(const bsdf& b, const direction_tree* dt, const vec3& point, const int id){
+    const vec3 origin = point + b.normal()*SHADOW_EPSILON;
+    const base_type u = rng(gen[id]), u1 = rng(gen[id]), u2 = rng(gen[id]);
+    light_sample ls;
+    if(!s.lights.sample(origin, b.normal(), u, u1, u2, ls)) return vec3(0.);
+    const vec3 f = b.eval(ls.direction);
+    if(f.values[0] + f.values[1] + f.values[2] <= 0.) return vec3(0.);
+    ray shadow; shadow.origin = origin; shadow.direction = ls.direction;
+    hitrecord lh = s.contents[ls.primitive]->intersect(shadow); // where on the light, for its emission
+    if(lh.dtransit <= 0. || lh.dtransit >= DMAX_TRAVEL) return vec3(0.);
+    lh.primitive_index = ls.primitive;
+    render_stats& st = stats[id]; st.shadow_rays++;
+    if(s.occluded(shadow, lh.dtransit - SHADOW_EPSILON, &st)) return vec3(0.);
+    return f * bsdf(lh).emitted() * (power_heuristic(ls.pdf, scatter_pdf(b, dt, ls.direction)) / ls.pdf);
+  }
+  void write(vec3 col, vec2 loc){ // writes to image buffer
+    if(loc.values[0] < 0 || loc.values[0] >= xdim) return;
+    if(loc.values[1] < 0 || loc.values[1] >= ydim) return;
+    const int index = 4.*(loc.values[1]*xdim+loc.values[0]);
+    for(int c = 0; c < 4; c++)
+      bytes[index+c] = (c == 3) ? 255 : col.values[c] * 255.;
+  }
+};
+
+#endif
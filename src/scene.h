@@ -0,0 +1,207 @@
+#ifndef SCENE_H
+#define SCENE_H
+
+#include <cstring> // memcmp
+
+#include "accel.h"
+#include "lights.h"
+
+//   todo : material handling
+
+
+
+class camera{ // camera class generates view vectors from a set of basis vectors
+public:
+  camera(){}
+  void resolution(const int xdim, const int ydim){ x = xdim; y = ydim; } // sets screen dimensions
+  void field_of_view(const base_type f){ FoV = f; }
+  void lookat(const vec3 from, const vec3 at, const vec3 up){
+    position = from;
+    bz = normalize(at-from);
+    bx = normalize(cross(up, bz));
+    by = normalize(cross(bx, bz));
+  }
+  ray sample(const vec2 p) const { // argument is pixel location - assumes any desired jitter is applied at call site
+    ray r;
+    r.origin = position;
+    // remap [0, dimension] indexing to [-dimension/2., dimension/2.]
+    base_type lx = (p.values[0] - base_type(x/2.)) / base_type(x/2.);
+    base_type ly = (p.values[1] - base_type(y/2.)) / base_type(y/2.);
+    base_type aspect_ratio = base_type(x) / base_type(y);            // calculate pixel offset
+    r.direction = normalize(aspect_ratio*lx*bx + ly*by + (1./FoV)*bz); // construct from basis
+    return r;
+  }
+  bool project(const vec3& p, vec2& pixel) const { // the image plane position whose ray passes through p - false if behind the camera
+    const vec3 v = p - position;
+    const base_type z = dot(v, bz);
+    if(z <= 0.) return false;
+    const base_type aspect_ratio = base_type(x) / base_type(y);
+    const base_type lx = dot(v, bx) / (z * FoV * aspect_ratio), ly = dot(v, by) / (z * FoV); // sample's basis, solved back
+    pixel = vec2(lx * base_type(x/2.) + base_type(x/2.), ly * base_type(y/2.) + base_type(y/2.));
+    return true;
+  }
+  bool operator==(const camera& o) const { // same rays for the same image plane samples
+    auto same = [](const vec3& a, const vec3& b){ return a.values[0] == b.values[0] && a.values[1] == b.values[1] && a.values[2] == b.values[2]; };
+    return same(position, o.position) && same(bx, o.bx) && same(by, o.by) && same(bz, o.bz) && FoV == o.FoV && x == o.x && y == o.y;
+  }
+private:
+  vec3 position;  // location of viewer
+  vec3 bx,by,bz;  // basis vectors for sample calcs
+  int x = X_IMAGE_DIM, y = Y_IMAGE_DIM; // overal dimensions of the screen
+  base_type FoV = FIELD_OF_VIEW; // field of view
+};
+
+
+class scene{ // scene as primitive list + material list container
+public:
+  scene() { }
+  void clear() { contents.clear(); accel.reset(); lights = light_tree(); version++; }
+  // count triangle+sphere pairs, seed 0 is random - woop stores the triangles in the transformed form
+  void populate(long long count=NUM_PRIMITIVES, unsigned long long seed=0, bool woop=false){
+    std::random_device r;
+    std::seed_seq s = seed ? std::seed_seq{uint32_t(seed), uint32_t(seed >> 32)} : std::seed_seq{r(), r(), r(), r(), r(), r(), r(), r(), r()};
+    auto gen = std::make_shared<std::mt19937_64>(s);
+    version++;
+    // for (int i = 0; i < 7; i++)
+      // contents.push_back(std::make_shared<sphere>(0.8*random_vector(gen), 0.03*rng(gen), 0));
+    for (int i = 0; i < count; i++){
+      base_type yval = ((base_type(i) / count) - 0.5)* 2.;
+      vec3 p1 = vec3(std::cos(yval*6.5), std::sin(yval*14.0), yval*3.14);
+      vec3 p2 = vec3(std::cos(yval*9.7)+0.1, std::sin(yval*16.4)+0.7, yval);
+      vec3 p3 = vec3(std::cos(yval*15.8)-0.3, std::sin(yval*19.2)+0.1, yval+0.3*rng(gen))+random_vector(gen)*0.04;
+      const int material = rng(gen) < 0.1 ? 1 : 3; // drawn first, the order the arguments were evaluated in when this was one call
+      const vec3 p3_or_random = rng(gen) < 0.1 ? random_vector(gen) : p3;
+      if(woop) contents.push_back(std::make_shared<woop_triangle>(p1, p2, p3_or_random, material));
+      else contents.push_back(std::make_shared<triangle>(p1, p2, p3_or_random, material));
+      contents.push_back(std::make_shared<sphere>(random_vector(gen), 0.4*rng(gen), rng(gen) < 0.4 ? 0 : 2));
+    }
+  }
+  // appends a mesh as triangles - .obj files are parsed (and cached as <file>.amesh if asked), .amesh files are mapped.
+  // fit scales and centers the mesh into the [-1,1] cube the procedural scene lives in
+  bool load_mesh(const std::string& path, int material, bool fit, bool cache, worker_pool& pool, bool woop=false){
+    const bool is_amesh = path.size() > 6 && path.compare(path.size()-6, 6, ".amesh") == 0;
+    const std::string amesh_path = is_amesh ? path : path + ".amesh";
+    mapped_file mapped(is_amesh || (cache && newer_than(amesh_path, path)) ? amesh_path : std::string());
+    mesh_data parsed; mesh_view view;
+    if(!map_amesh(mapped, view)){
+      if(is_amesh){ cerr << "bad mesh cache \'" << path << "\'" << endl; return false; }
+      if(!load_obj(path, parsed, pool)) return false;
+      if(cache && !save_amesh(amesh_path, parsed)) cerr << "couldn't write mesh cache \'" << amesh_path << "\'" << endl;
+      view = view_of(parsed);
+    }
+
+    // bounds for fitting, reduced per worker
+    std::vector<vec3> lo(pool.size(), vec3(DMAX_TRAVEL)), hi(pool.size(), vec3(-DMAX_TRAVEL));
+    std::atomic<bool> ok{true};
+    pool.parallel_for(view.triangle_count*3, [&](size_t b, size_t e, int id){
+      for(size_t i = b; i < e; i++){
+        if(view.indices[i] >= view.vertex_count){ ok = false; return; }
+        for(int a = 0; a < 3; a++){
+          lo[id].values[a] = std::min(lo[id].values[a], view.vertices[view.indices[i]].values[a]);
+          hi[id].values[a] = std::max(hi[id].values[a], view.vertices[view.indices[i]].values[a]);
+        }
+      }
+    }, 4096);
+    if(!ok){ cerr << "mesh \'" << path << "\' has out of range indices" << endl; return false; }
+    vec3 center(0.); base_type scale = 1.;
+    if(fit && view.triangle_count){
+      vec3 l = lo[0], h = hi[0];
+      for(int id = 1; id < pool.size(); id++)
+        for(int a = 0; a < 3; a++){ l.values[a] = std::min(l.values[a], lo[id].values[a]); h.values[a] = std::max(h.values[a], hi[id].values[a]); }
+      const vec3 extent = h - l;
+      center = (l + h) * 0.5;
+      scale = 2. / std::max(std::max(extent.values[0], extent.values[1]), std::max(extent.values[2], HIT_EPSILON));
+    }
+
+    // triangles go into one block per chunk, referenced from contents with aliasing pointers - no
+    // allocation per triangle, and the reference counting on each block stays on one thread
+    const size_t base = contents.size();
+    contents.resize(base + view.triangle_count); version++;
+    auto fill = [&](auto kind){
+      using tri = decltype(kind);
+      pool.parallel_for(view.triangle_count, [&](size_t b, size_t e, int){
+        std::shared_ptr<tri[]> block(new tri[e-b]);
+        for(size_t i = b; i < e; i++){
+          const uint32_t* t = &view.indices[3*i];
+          block[i-b] = tri((view.vertices[t[0]]-center)*scale, (view.vertices[t[1]]-center)*scale, (view.vertices[t[2]]-center)*scale, material);
+          contents[base+i] = std::shared_ptr<primitive>(block, &block[i-b]);
+        }
+      }, 1024);
+    };
+    if(woop) fill(woop_triangle()); else fill(triangle());
+    return true;
+  }
+  // builds the named backend over contents, again after changing them - false for an unknown name. the
+  // structure is made fresh each time, so copies of the scene never see each other's builds
+  bool build_accel(const std::string& backend = "bvh", const accel_settings& settings = accel_settings(), worker_pool* pool = nullptr, bool validate = false){
+    std::shared_ptr<accelerator> a = make_accelerator(backend, settings, validate);
+    if(!a){ cerr << "unknown acceleration structure \'" << backend << "\'" << endl; return false; }
+    a->build(contents, pool);
+    accel = a;
+    return true;
+  }
+  // the emitters next event estimation picks from, again after moving them - false for an unknown mode
+  bool build_lights(const std::string& mode){
+    light_mode m;
+    if(!parse_light_mode(mode, m)){ cerr << "unknown light sampling '" << mode << "'" << endl; return false; }
+    lights.build(contents, m);
+    return true;
+  }
+  // after moving primitives - the backend updates itself in place if it can, or rebuilds. true if it rebuilt
+  bool refit_accel(const base_type threshold, worker_pool* pool = nullptr){
+    return accel ? accel->refit(contents, threshold, pool) : false;
+  }
+  // replaces primitive i's geometry and material with a record of the same type - true if the geometry changed, and
+  // with it the version, so the structure needs a refit
+  bool edit(const size_t i, const primitive_record& r){
+    primitive& p = *contents[i];
+    const primitive_record before = p.record();
+    p.material_index = r.material;
+    if(std::memcmp(before.data, r.data, sizeof(r.data)) == 0 && before.object == r.object) return false;
+    p.update(r);
+    if(i < rest_pose.size()) rest_pose[i] = r; // animation moves it from here on
+    version++;
+    return true;
+  }
+  // moves every primitive a little away from where it was on the first call, smoothly in time - a stand in for
+  // real animation data, with the topology unchanged between frames
+  void animate(const base_type time){
+    version++;
+    if(rest_pose.size() != contents.size()){
+      rest_pose.resize(contents.size());
+      for(size_t i = 0; i < contents.size(); i++) rest_pose[i] = contents[i]->record();
+    }
+    auto wobble = [time](size_t i, int k){ // small per primitive, per point offset
+      const base_type phase = base_type(i) * 0.618 + k * 2.1;
+      return vec3(std::sin(time*1.3 + phase), std::sin(time*1.7 + 2.*phase), std::sin(time*1.1 + 3.*phase)) * ANIMATION_AMPLITUDE;
+    };
+    for(size_t i = 0; i < contents.size(); i++){
+      primitive_record r = rest_pose[i];
+      const int points = r.type == TRIANGLE ? 3 : 1;
+      for(int k = 0; k < points; k++){
+        const vec3 d = wobble(i, k);
+        for(int a = 0; a < 3; a++) // spheres and triangles store points at 3k, instances translations at 4a+3
+          r.data[r.type == INSTANCE ? 4*a+3 : 3*k+a] += d.values[a];
+      }
+      contents[i]->update(r);
+    }
+  }
+  hitrecord ray_query(ray r, render_stats* stats=nullptr) const {
+    if(accel && accel->valid_for(contents))
+      return accel->intersect(r, contents, stats);
+    return linear_accel::scan(r, contents, stats); // nothing built - check every primitive for the nearest intersection
+  }
+  bool occluded(const ray& r, const base_type tmax, render_stats* stats=nullptr) const { // anything hit in (0, tmax)
+    if(accel && accel->valid_for(contents))
+      return accel->intersect_any(r, tmax, contents, stats);
+    return linear_accel::scan_any(r, tmax, contents, stats);
+  }
+  std::vector<std::shared_ptr<primitive>> contents; // list of primitives making up the scene
+  std::shared_ptr<accelerator> accel; // acceleration structure over contents, used by ray_query once built
+  light_tree lights; // emissive primitives, for sampling them directly
+  std::vector<primitive_record> rest_pose; // contents as they were before animate() moved them
+  unsigned long long version = 0; // bumped whenever contents are added, removed or moved, so caches over them can tell
+  // std::vector<std::shared_ptr<material>> materials; // list of materials present in the scene
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef TERMINATION_H
+#define TERMINATION_H
+
+#include "core.h"
+
+// when a path stops - russian roulette lets it survive a bounce with probability q and divides the survivors by q,
+// which keeps the estimate unbiased. the policies differ in how q is picked:
+//   max         the largest throughput channel (the original policy)
+//   luminance   the luminance of the throughput, which includes the 1/q of earlier survivals
+//   efficiency  the q that best trades the variance roulette adds against the rays it saves. it uses the pixel's
+//               own sample variance, and the tile's statistics of the light found after each depth
+// all of them leave the first rr_min_depth bounces alone. luminance and efficiency cap q at rr_max_survival, so
+// paths over near-white surfaces end too
+
+enum rr_policy{ RR_MAX, RR_LUMINANCE, RR_EFFICIENCY, RR_POLICY_COUNT };
+constexpr const char* RR_POLICY_NAMES[RR_POLICY_COUNT] = { "max", "luminance", "efficiency" };
+constexpr base_type RR_MIN_SURVIVAL = 0.05; // floor under luminance and efficiency q - survivors are scaled at most 20x
+constexpr unsigned RR_EFFICIENCY_WARMUP = 16; // paths seen past a depth before its statistics are trusted
+
+inline bool parse_rr_policy(const std::string& name, rr_policy& p){
+  for(int i = 0; i < RR_POLICY_COUNT; i++)
+    if(name == RR_POLICY_NAMES[i]){ p = rr_policy(i); return true; }
+  return false;
+}
+
+struct pixel_estimate{ // running mean and variance of one pixel's sample luminance (Welford)
+  unsigned n = 0; base_type mean = 0., m2 = 0.;
+  void add(base_type l){ n++; const base_type d = l - mean; mean += d / n; m2 += d * (l - mean); }
+  base_type variance() const { return n > 1 ? m2 / (n - 1) : 0.; }
+};
+
+// per depth over a tile's paths: second moment of the light a path gathered after that depth, per unit of its
+// throughput there, and the rays it spent doing so. kept per tile so that seeded renders stay schedule independent
+class path_statistics{
+public:
+  void reset(int depths){ sum2.assign(depths, 0.); rays.assign(depths, 0.); count.assign(depths, 0); visits.clear(); }
+  void begin(){ visits.clear(); }
+  // a path survived roulette at this depth, with throughput luminance w and probability q, having gathered 'so_far'
+  void survived(int depth, base_type w, base_type q, base_type so_far, unsigned long long rays_so_far){
+    visits.push_back({ depth, w, q, so_far, rays_so_far });
+  }
+  void finish(base_type gathered, unsigned long long rays_total){ // the continuation without roulette is q times what the survivor found
+    for(const visit& v : visits){
+      if(v.weight <= 0.) continue;
+      const base_type l = v.survival * (gathered - v.gathered) / v.weight;
+      sum2[v.depth] += l*l; rays[v.depth] += double(rays_total - v.rays); count[v.depth]++;
+    }
+  }
+  bool known(int depth) const { return count[depth] >= RR_EFFICIENCY_WARMUP; }
+  base_type second_moment(int depth) const { return sum2[depth] / count[depth]; }
+  base_type cost(int depth) const { return rays[depth] / count[depth]; }
+private:
+  struct visit{ int depth; base_type weight, survival, gathered; unsigned long long rays; };
+  std::vector<base_type> sum2, rays;
+  std::vector<unsigned> count;
+  std::vector<visit> visits; // the current path's survivals
+};
+
+struct termination_policy{
+  rr_policy policy = RR_MAX;
+  int min_depth = 0;            // bounces before roulette starts
+  base_type max_survival = 0.95; // cap on q for luminance and efficiency
+
+  // survival probability at this depth, 1 to always continue. throughput already includes earlier 1/q factors
+  base_type survival(const vec3& throughput, int depth, const pixel_estimate& px, const path_statistics& ps) const {
+    if(depth < min_depth) return 1.;
+    if(policy == RR_MAX) return std::min(std::max(throughput.values[0], std::max(throughput.values[1], throughput.values[2])), 1.); // guided bounces can weigh over 1
+    const base_type w = luminance(throughput);
+    if(w <= 0.) return 0.;
+    base_type q = w;
+    if(policy == RR_EFFICIENCY && px.n > 1 && ps.known(depth)){
+      // one sample costs depth+1 rays plus c after this point, and has variance V. surviving with q adds
+      // (1/q - 1) w^2 m2 to the variance and saves (1-q) c rays - variance times cost is smallest at
+      //   q = sqrt(w^2 m2 (depth+1) / ((V - w^2 m2) c))
+      const base_type a = w*w * ps.second_moment(depth), c = ps.cost(depth), v = px.variance();
+      q = (v <= a || c <= 0.) ? 1. : std::sqrt(a * (depth + 1) / ((v - a) * c));
+    }
+    return std::clamp(q, RR_MIN_SURVIVAL, max_survival);
+  }
+  bool learns() const { return policy == RR_EFFICIENCY; }
+  std::string name() const { return RR_POLICY_NAMES[policy]; }
+};
+
+#endif